@@ -1,18 +1,44 @@
 #include <Arduino.h>
 #include <ESP8266WiFi.h>
 #include <ESP8266WebServer.h>
+#include <WiFiUdp.h>
 #include <EEPROM.h>
 #include <Adafruit_NeoPixel.h>
+#include <AsyncMqttClient.h>
+#include <Updater.h>
+#include <eboot_command.h>
 #include <math.h>
 #include <time.h>
 
 #include "secrets.h"
 
+// MQTT is optional: leave MQTT_HOST undefined in secrets.h to disable the bridge.
+#ifndef MQTT_HOST
+#define MQTT_HOST ""
+#endif
+#ifndef MQTT_PORT
+#define MQTT_PORT 1883
+#endif
+#ifndef MQTT_USER
+#define MQTT_USER ""
+#endif
+#ifndef MQTT_PASS
+#define MQTT_PASS ""
+#endif
+
+// OTA stays disabled until OTA_PASS is defined in secrets.h.
+#ifndef OTA_USER
+#define OTA_USER "admin"
+#endif
+#ifndef OTA_PASS
+#define OTA_PASS ""
+#endif
+
 namespace {
 constexpr uint8_t LED_PIN = D4;
 constexpr uint8_t BTN_PIN = D5;
 constexpr uint16_t LED_COUNT = 63;
-constexpr uint16_t EEPROM_SIZE = 64;
+constexpr uint16_t EEPROM_SIZE = 512;
 constexpr uint32_t SAVE_DELAY_MS = 1200;
 constexpr uint32_t WIFI_RETRY_MS = 5000;
 constexpr uint16_t KELVIN_MIN = 1000;
@@ -22,8 +48,55 @@ constexpr int32_t TZ_OFFSET_SECONDS = TIMEZONE_UTC_HOURS * 3600;
 constexpr uint16_t MAX_STRIP_CURRENT_MA = 1800;
 constexpr uint32_t SCHEDULE_CHECK_MS = 2000;
 constexpr uint32_t BUTTON_DEBOUNCE_MS = 60;
+constexpr uint32_t BUTTON_LONG_PRESS_MS = 800;
 constexpr uint32_t POWER_FADE_DURATION_MS = 1000;
 constexpr uint32_t FADE_FRAME_INTERVAL_MS = 16;
+constexpr uint8_t MAX_BATCH_COMMANDS = 16;
+constexpr uint8_t MAX_BATCH_ERRORS = 8;
+constexpr uint8_t PRESET_COUNT = 8;
+constexpr uint8_t PRESET_NAME_LENGTH = 12;
+constexpr uint8_t PRESET_MARKER = 0x5C;
+constexpr uint8_t PRESET_NONE = 0xFF;
+constexpr uint16_t PRESETS_EEPROM_OFFSET = 32;
+constexpr uint32_t PRESET_CROSSFADE_MS = 600;
+constexpr uint8_t GROUP_NONE = 0;
+constexpr uint16_t GROUP_UDP_PORT = 4210;
+constexpr uint16_t GROUP_PROTOCOL_MAGIC = 0x4C45;
+constexpr uint8_t GROUP_PROTOCOL_VERSION = 1;
+constexpr uint8_t GROUP_MAX_PEERS = 8;
+constexpr uint8_t GROUP_CLOCK_SAMPLES = 4;
+constexpr uint8_t GROUP_STATE_REPEATS = 2;
+constexpr uint8_t GROUP_MAX_PACKETS_PER_LOOP = 4;
+constexpr uint32_t GROUP_START_DELAY_MS = 150;
+constexpr uint32_t GROUP_BEACON_INTERVAL_MS = 1000;
+constexpr uint32_t GROUP_PEER_TIMEOUT_MS = 5000;
+constexpr uint32_t GROUP_MAX_SYNC_RTT_MS = 100;
+constexpr uint32_t GROUP_REFERENCE_GRACE_MS = 3 * GROUP_BEACON_INTERVAL_MS;
+constexpr uint32_t MQTT_RETRY_MIN_MS = 2000;
+constexpr uint32_t MQTT_RETRY_MAX_MS = 60000;
+constexpr uint32_t MQTT_CONNECT_TIMEOUT_MS = 15000;
+constexpr uint32_t MQTT_PUBLISH_MIN_INTERVAL_MS = 250;
+constexpr uint16_t MQTT_KEEPALIVE_S = 30;
+constexpr uint8_t MQTT_TOPIC_LENGTH = 48;
+constexpr uint8_t MQTT_COMMAND_LENGTH = 48;
+constexpr uint8_t MQTT_SUFFIX_LENGTH = 16;
+constexpr uint8_t MQTT_INBOX_SIZE = 4;
+constexpr uint32_t OTA_MIN_FREE_HEAP = 12000;
+constexpr uint32_t OTA_RESTART_DELAY_MS = 500;
+constexpr uint32_t OTA_HEALTHY_AFTER_MS = 30000;
+constexpr uint8_t OTA_MAX_UNHEALTHY_BOOTS = 3;
+constexpr uint32_t OTA_HEALTH_MAGIC = 0x4F544148;
+constexpr uint32_t OTA_HEALTH_RTC_BLOCK = 32;
+constexpr uint16_t STRIP_VOLTAGE_MV = 5000;
+constexpr uint8_t ENERGY_HOUR_BUCKETS = 48;
+constexpr uint8_t ENERGY_DAY_BUCKETS = 31;
+constexpr uint32_t ENERGY_MAGIC = 0x454E5247;
+constexpr uint32_t ENERGY_TICK_MS = 1000;
+constexpr uint32_t ENERGY_RTC_SNAPSHOT_MS = 60000;
+constexpr uint32_t ENERGY_RTC_BLOCK = 34;
+constexpr uint32_t MS_PER_HOUR = 3600000;
+constexpr uint32_t MA_MS_PER_MAH = 3600000;
+constexpr uint16_t ENERGY_EEPROM_OFFSET = 192;
 
 struct PersistedSettings {
   uint8_t marker;
@@ -35,11 +108,175 @@ struct PersistedSettings {
   uint8_t offHour;
   uint8_t offMinute;
   uint8_t scheduleEnabled;
+  uint8_t groupId;
+};
+
+enum GroupPacketType : uint8_t {
+  GROUP_PACKET_BEACON = 1,
+  GROUP_PACKET_CLOCK_REQUEST = 2,
+  GROUP_PACKET_CLOCK_RESPONSE = 3,
+  GROUP_PACKET_STATE = 4
+};
+
+enum GroupStateFlags : uint8_t {
+  GROUP_STATE_CROSSFADE = 0x01
+};
+
+// Wire format shared by every group member; all fields are little-endian.
+// Times named "group" are on the leader's clock, t0 is the requester's millis().
+struct __attribute__((packed)) GroupPacket {
+  uint16_t magic;
+  uint8_t version;
+  uint8_t type;
+  uint8_t groupId;
+  uint8_t flags;
+  uint32_t nodeId;
+  uint32_t seq;
+  uint32_t t0;
+  uint32_t groupTime;
+  uint16_t temperature;
+  uint8_t brightness;
+  uint8_t power;
+};
+
+struct GroupPeer {
+  uint32_t nodeId;
+  IPAddress ip;
+  uint32_t lastSeenAt;
+};
+
+struct GroupClockSample {
+  uint32_t rtt;
+  uint32_t offset;
+};
+
+struct MqttPublishedState {
+  bool valid;
+  uint8_t brightness;
+  uint16_t temperature;
+  uint8_t power;
+};
+
+struct MqttStats {
+  uint32_t published;
+  uint32_t received;
+  uint32_t rejected;
+  uint32_t connects;
+  uint32_t failedConnects;
+  uint32_t loopCalls;
+  uint64_t loopTotalUs;
+  uint32_t loopMaxUs;
+};
+
+// Messages arrive in the TCP stack's context, where touching the strip or
+// EEPROM is not allowed; the callback only copies them for loop().
+struct MqttInboxMessage {
+  char suffix[MQTT_SUFFIX_LENGTH];
+  char payload[MQTT_COMMAND_LENGTH];
+  uint8_t length;
+};
+
+enum class OtaState : uint8_t {
+  Idle,
+  Receiving,
+  Done,
+  Failed
+};
+
+struct OtaStatus {
+  OtaState state;
+  const char *error;
+  uint32_t bytes;
+  uint32_t startedAt;
+  uint32_t durationMs;
+  uint32_t startFreeHeap;
+  uint32_t minFreeHeap;
+};
+
+// Kept in RTC memory, which survives resets but not power loss, so a new
+// image can be watched across the reboots it causes.
+struct OtaHealthRecord {
+  uint32_t magic;
+  uint8_t pending;
+  uint8_t bootAttempts;
+  // First 16 bits of the uploaded image's MD5, to tell it from the old one after the reboot.
+  uint16_t imageTag;
+};
+
+static_assert(sizeof(OtaHealthRecord) % 4 == 0, "RTC memory is accessed in 4-byte blocks");
+// Update.end() stages eboot's copy command in RTC user blocks 0-31; writing there would cancel the update.
+static_assert(OTA_HEALTH_RTC_BLOCK >= 32 && OTA_HEALTH_RTC_BLOCK * 4 + sizeof(OtaHealthRecord) <= ENERGY_RTC_BLOCK * 4,
+              "OTA health record must sit between eboot's blocks and the energy log");
+
+struct DiagStats {
+  uint32_t loops;
+  uint32_t loopMaxUs;
+  uint32_t heapLowWater;
+  uint32_t fadeFrames;
+  uint32_t missedFadeFrames;
+};
+
+struct PendingGroupState {
+  bool active;
+  uint32_t startAt;
+  uint8_t brightness;
+  uint16_t temperature;
+  uint8_t power;
+  uint8_t flags;
+};
+
+// A scene keeps its already resolved, current-limited base color so recall
+// does not need to run the Kelvin -> RGB pipeline again.
+struct ScenePreset {
+  uint8_t marker;
+  uint8_t brightness;
+  uint16_t temperature;
+  uint8_t r;
+  uint8_t g;
+  uint8_t b;
+  char name[PRESET_NAME_LENGTH + 1];
+};
+
+struct ResolvedColor {
+  bool valid;
+  uint8_t brightness;
+  uint16_t temperature;
+  uint8_t r;
+  uint8_t g;
+  uint8_t b;
+};
+
+// Hourly and daily mAh buckets of the modeled strip current. Both rings are
+// indexed by local hour/day number modulo their size, so no head pointer is
+// stored. A uint16_t day bucket holds 24 h at MAX_STRIP_CURRENT_MA.
+struct EnergyLog {
+  uint32_t magic;
+  uint32_t hourIndex;
+  uint32_t totalMah;
+  uint16_t hours[ENERGY_HOUR_BUCKETS];
+  uint16_t days[ENERGY_DAY_BUCKETS];
+  uint16_t reserved;
+  uint32_t checksum;
 };
 
-PersistedSettings settings = {0xA5, 70, 2000, 1, 18, 0, 23, 30, 0};
+static_assert(sizeof(PersistedSettings) <= PRESETS_EEPROM_OFFSET, "Settings overlap preset storage");
+static_assert(PRESETS_EEPROM_OFFSET + sizeof(ScenePreset) * PRESET_COUNT <= ENERGY_EEPROM_OFFSET, "Presets overlap energy log");
+static_assert(ENERGY_EEPROM_OFFSET + sizeof(EnergyLog) <= EEPROM_SIZE, "Energy log does not fit EEPROM");
+static_assert(sizeof(EnergyLog) % 4 == 0, "RTC memory is accessed in 4-byte blocks");
+// eboot keeps its command in RTC user blocks 0-31 (lost on OTA), and the
+// user area is 128 blocks of 4 bytes.
+static_assert(ENERGY_RTC_BLOCK >= 32 && ENERGY_RTC_BLOCK * 4 + sizeof(EnergyLog) <= 512, "Energy log must stay clear of eboot's RTC blocks");
+static_assert(static_cast<uint32_t>(MAX_STRIP_CURRENT_MA) * 24 <= 0xFFFF, "Day bucket would overflow");
+
+PersistedSettings settings = {0xA5, 70, 2000, 1, 18, 0, 23, 30, 0, GROUP_NONE};
+ScenePreset presets[PRESET_COUNT] = {};
+ResolvedColor resolvedColor = {};
+uint8_t activePresetId = PRESET_NONE;
 
 ESP8266WebServer server(80);
+WiFiUDP groupUdp;
+AsyncMqttClient mqttClient;
+const IPAddress GROUP_MULTICAST_IP(239, 255, 76, 69);
 Adafruit_NeoPixel strip(LED_COUNT, LED_PIN, NEO_GRB + NEO_KHZ800);
 
 bool pendingSave = false;
@@ -52,10 +289,106 @@ uint32_t lastFadeFrameAt = 0;
 bool buttonStableState = true;
 bool buttonLastReading = true;
 uint32_t buttonLastChangeAt = 0;
+uint32_t buttonPressedAt = 0;
+bool buttonLongPressHandled = false;
 bool fadeActive = false;
 uint8_t fadeStartScale255 = 0;
 uint8_t fadeTargetScale255 = 0;
 uint8_t lastPowerState = 0;
+bool colorFadeActive = false;
+uint32_t colorFadeStartedAt = 0;
+uint8_t colorFadeFrom[3] = {0, 0, 0};
+uint8_t lastBaseColor[3] = {0, 0, 0};
+
+uint32_t groupNodeId = 0;
+bool groupUdpStarted = false;
+uint8_t groupUdpJoinedId = GROUP_NONE;
+bool groupJoinFailed = false;
+uint32_t lastGroupJoinAttemptAt = 0;
+uint32_t groupJoinedAt = 0;
+uint32_t groupSeq = 0;
+uint32_t lastGroupBeaconAt = 0;
+uint32_t groupClockOffset = 0;
+bool groupClockSynced = false;
+uint32_t groupClockReferenceId = 0;
+uint32_t groupLastSyncRtt = 0;
+GroupPeer groupPeers[GROUP_MAX_PEERS] = {};
+GroupClockSample groupClockSamples[GROUP_CLOCK_SAMPLES] = {};
+uint8_t groupClockSampleCount = 0;
+uint8_t groupClockSampleNext = 0;
+uint32_t lastGroupStateNodeId = 0;
+uint32_t lastGroupStateSeq = 0;
+PendingGroupState pendingGroupState = {};
+
+char mqttBaseTopic[MQTT_TOPIC_LENGTH] = "";
+char mqttClientId[24] = "";
+char mqttWillTopic[MQTT_TOPIC_LENGTH + 16] = "";
+volatile bool mqttConnecting = false;
+volatile bool mqttSessionStarted = false;
+MqttInboxMessage mqttInbox[MQTT_INBOX_SIZE] = {};
+volatile uint8_t mqttInboxHead = 0;
+volatile uint8_t mqttInboxTail = 0;
+uint32_t mqttRetryDelayMs = MQTT_RETRY_MIN_MS;
+uint32_t lastMqttAttemptAt = 0;
+uint32_t lastMqttPublishAt = 0;
+MqttPublishedState mqttPublished = {};
+MqttStats mqttStats = {};
+
+OtaStatus otaStatus = {OtaState::Idle, nullptr, 0, 0, 0, 0, 0};
+OtaHealthRecord otaHealth = {};
+uint16_t otaImageTag = 0;
+bool otaRecoveryMode = false;
+uint32_t otaRestartAt = 0;
+
+DiagStats diagStats = {0, 0, UINT32_MAX, 0, 0};
+bool fadeFramesRunning = false;
+
+EnergyLog energyLog = {};
+uint32_t energyCurrentMa = 0;
+uint32_t energyIntegratedAt = 0;
+uint32_t energyAccumMaMs = 0;
+uint32_t lastEnergyTickAt = 0;
+uint32_t lastEnergySnapshotAt = 0;
+uint32_t energyHourStartedAt = 0;
+bool energyClockAnchored = false;
+
+enum BatchField : uint8_t {
+  BATCH_FIELD_BRIGHTNESS,
+  BATCH_FIELD_TEMPERATURE,
+  BATCH_FIELD_ON,
+  BATCH_FIELD_SCHEDULE,
+  BATCH_FIELD_ON_TIME,
+  BATCH_FIELD_OFF_TIME,
+  BATCH_FIELD_GROUP,
+  BATCH_FIELD_COUNT,
+  BATCH_FIELD_UNKNOWN = 0xFF
+};
+
+const char *const BATCH_FIELD_NAMES[BATCH_FIELD_COUNT] = {
+    "brightness", "temperature", "on", "schedule", "onTime", "offTime", "group"};
+
+enum class BatchError : uint8_t {
+  None,
+  Syntax,
+  UnknownKey,
+  BadValue,
+  OutOfRange,
+  TooMany
+};
+
+struct BatchFieldError {
+  uint8_t index;
+  uint8_t field;
+  BatchError error;
+};
+
+struct CommandBatch {
+  PersistedSettings staged;
+  uint8_t commandCount;
+  uint8_t errorCount;
+  bool errorsTruncated;
+  BatchFieldError errors[MAX_BATCH_ERRORS];
+};
 
 const char INDEX_HTML[] PROGMEM = R"HTML(
 <!doctype html>
@@ -434,18 +767,110 @@ uint8_t getCurrentFadeScale255() {
   return clampU8(value);
 }
 
-void startPowerFade(uint8_t targetScale255) {
+void startPowerFade(uint8_t targetScale255, uint32_t startedAt) {
   uint8_t currentScale255 = getCurrentFadeScale255();
   fadeStartScale255 = currentScale255;
   fadeTargetScale255 = targetScale255;
-  fadeStartedAt = millis();
+  fadeStartedAt = startedAt;
   fadeActive = fadeStartScale255 != fadeTargetScale255;
 }
 
+void resolveColor(uint8_t brightness, uint16_t temperature, uint8_t &r, uint8_t &g, uint8_t &b) {
+  if (!resolvedColor.valid ||
+      resolvedColor.brightness != brightness ||
+      resolvedColor.temperature != temperature) {
+    temperatureToRGB(temperature, r, g, b);
+    r = applyBrightness(r, brightness);
+    g = applyBrightness(g, brightness);
+    b = applyBrightness(b, brightness);
+    limitRgbByCurrent(r, g, b);
+    resolvedColor = {true, brightness, temperature, r, g, b};
+    return;
+  }
+
+  r = resolvedColor.r;
+  g = resolvedColor.g;
+  b = resolvedColor.b;
+}
+
+void resolveBaseColor(uint8_t &r, uint8_t &g, uint8_t &b) {
+  resolveColor(settings.brightness, settings.temperature, r, g, b);
+}
+
+uint8_t blendChannel(uint8_t from, uint8_t to, uint32_t elapsed, uint32_t duration) {
+  int32_t delta = static_cast<int32_t>(to) - static_cast<int32_t>(from);
+  return clampU8(static_cast<int32_t>(from) + (delta * static_cast<int32_t>(elapsed)) / static_cast<int32_t>(duration));
+}
+
+void applyColorCrossfade(uint8_t &r, uint8_t &g, uint8_t &b) {
+  if (!colorFadeActive) {
+    return;
+  }
+
+  uint32_t elapsed = millis() - colorFadeStartedAt;
+  if (elapsed >= PRESET_CROSSFADE_MS) {
+    colorFadeActive = false;
+    return;
+  }
+
+  r = blendChannel(colorFadeFrom[0], r, elapsed, PRESET_CROSSFADE_MS);
+  g = blendChannel(colorFadeFrom[1], g, elapsed, PRESET_CROSSFADE_MS);
+  b = blendChannel(colorFadeFrom[2], b, elapsed, PRESET_CROSSFADE_MS);
+}
+
+void startColorCrossfade(uint32_t startedAt) {
+  // Crossfade from whatever is on the strip right now; when it is dark the power fade covers the transition.
+  if (getCurrentFadeScale255() == 0) {
+    return;
+  }
+  memcpy(colorFadeFrom, lastBaseColor, sizeof(colorFadeFrom));
+  colorFadeStartedAt = startedAt;
+  colorFadeActive = true;
+}
+
+// Integrates the current of the frame that was on the strip until now and
+// switches to the new one: a subtraction, a multiply and an add per frame.
+void accountEnergy(uint32_t newCurrentMa) {
+  uint32_t now = millis();
+  energyAccumMaMs += energyCurrentMa * (now - energyIntegratedAt);
+  energyIntegratedAt = now;
+  energyCurrentMa = newCurrentMa;
+
+  if (energyAccumMaMs < MA_MS_PER_MAH) {
+    return;
+  }
+  uint32_t mah = energyAccumMaMs / MA_MS_PER_MAH;
+  energyAccumMaMs -= mah * MA_MS_PER_MAH;
+
+  uint16_t &hour = energyLog.hours[energyLog.hourIndex % ENERGY_HOUR_BUCKETS];
+  uint16_t &day = energyLog.days[(energyLog.hourIndex / 24) % ENERGY_DAY_BUCKETS];
+  hour = static_cast<uint16_t>(hour + mah > 0xFFFF ? 0xFFFF : hour + mah);
+  day = static_cast<uint16_t>(day + mah > 0xFFFF ? 0xFFFF : day + mah);
+  energyLog.totalMah += mah;
+}
+
+uint32_t computeEnergyChecksum(const EnergyLog &log) {
+  // FNV-1a over everything but the checksum itself.
+  const uint8_t *bytes = reinterpret_cast<const uint8_t *>(&log);
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < offsetof(EnergyLog, checksum); i++) {
+    hash = (hash ^ bytes[i]) * 16777619u;
+  }
+  return hash;
+}
+
+bool isEnergyLogValid(const EnergyLog &log) {
+  return log.magic == ENERGY_MAGIC && log.checksum == computeEnergyChecksum(log);
+}
+
+void sealEnergyLog() {
+  energyLog.checksum = computeEnergyChecksum(energyLog);
+}
+
 void applyStripState(bool logState = true) {
   if (settings.power != lastPowerState) {
     lastPowerState = settings.power;
-    startPowerFade(settings.power != 0 ? 255 : 0);
+    startPowerFade(settings.power != 0 ? 255 : 0, millis());
   }
 
   uint8_t r = 0;
@@ -454,11 +879,11 @@ void applyStripState(bool logState = true) {
   uint8_t powerScale255 = getCurrentFadeScale255();
 
   if (powerScale255 > 0) {
-    temperatureToRGB(settings.temperature, r, g, b);
-    r = applyBrightness(r, settings.brightness);
-    g = applyBrightness(g, settings.brightness);
-    b = applyBrightness(b, settings.brightness);
-    limitRgbByCurrent(r, g, b);
+    resolveBaseColor(r, g, b);
+    applyColorCrossfade(r, g, b);
+    lastBaseColor[0] = r;
+    lastBaseColor[1] = g;
+    lastBaseColor[2] = b;
     r = scaleChannelBy255(r, powerScale255);
     g = scaleChannelBy255(g, powerScale255);
     b = scaleChannelBy255(b, powerScale255);
@@ -469,6 +894,7 @@ void applyStripState(bool logState = true) {
   }
 
   strip.show();
+  accountEnergy(estimateCurrentMa(r, g, b));
 
   if (logState) {
     Serial.printf("[LED] Power=%u Brightness=%u Temp=%uK Fade=%u RGB=(%u,%u,%u) MaxCurrent=%umA\n",
@@ -484,28 +910,45 @@ void applyStripState(bool logState = true) {
 }
 
 void updateFadeAnimation() {
-  if (!fadeActive) {
+  if (!fadeActive && !colorFadeActive) {
+    fadeFramesRunning = false;
     return;
   }
 
-  if (millis() - lastFadeFrameAt < FADE_FRAME_INTERVAL_MS) {
+  uint32_t now = millis();
+  uint32_t sinceLastFrame = now - lastFadeFrameAt;
+  if (sinceLastFrame < FADE_FRAME_INTERVAL_MS) {
     return;
   }
-  lastFadeFrameAt = millis();
+  // A slow loop() shows up as whole frame slots skipped inside a running fade.
+  if (fadeFramesRunning && sinceLastFrame >= 2 * FADE_FRAME_INTERVAL_MS) {
+    diagStats.missedFadeFrames += sinceLastFrame / FADE_FRAME_INTERVAL_MS - 1;
+  }
+  fadeFramesRunning = true;
+  diagStats.fadeFrames++;
+  lastFadeFrameAt = now;
   applyStripState(false);
 }
 
+// Handlers call this right before sending, while the response String and the
+// client buffers are still allocated; loop() alone would only see idle heap.
+void sampleHeapLowWater() {
+  uint32_t freeHeap = ESP.getFreeHeap();
+  if (freeHeap < diagStats.heapLowWater) {
+    diagStats.heapLowWater = freeHeap;
+  }
+}
+
 void requestSave() {
   pendingSave = true;
   saveRequestedAt = millis();
 }
 
-void saveSettingsIfNeeded() {
-  if (!pendingSave || millis() - saveRequestedAt < SAVE_DELAY_MS) {
-    return;
-  }
-
+void saveSettings() {
+  sealEnergyLog();
   EEPROM.put(0, settings);
+  EEPROM.put(PRESETS_EEPROM_OFFSET, presets);
+  EEPROM.put(ENERGY_EEPROM_OFFSET, energyLog);
   bool committed = EEPROM.commit();
   pendingSave = false;
 
@@ -516,6 +959,17 @@ void saveSettingsIfNeeded() {
                 settings.power);
 }
 
+void saveSettingsIfNeeded() {
+  if (!pendingSave || millis() - saveRequestedAt < SAVE_DELAY_MS) {
+    return;
+  }
+  // An EEPROM commit erases a flash sector; keep it out of the way of a running update.
+  if (otaStatus.state == OtaState::Receiving) {
+    return;
+  }
+  saveSettings();
+}
+
 void loadSettings() {
   PersistedSettings loaded{};
   EEPROM.get(0, loaded);
@@ -528,6 +982,10 @@ void loadSettings() {
                  loaded.scheduleEnabled <= 1;
 
   if (isValid) {
+    // Settings written before groups existed leave erased flash in this byte.
+    if (loaded.groupId == 0xFF) {
+      loaded.groupId = GROUP_NONE;
+    }
     // Migrate legacy brightness scale 0..255 to percent scale 0..100.
     if (loaded.brightness > 100) {
       loaded.brightness = static_cast<uint8_t>((static_cast<uint16_t>(loaded.brightness) * 100 + 127) / 255);
@@ -543,170 +1001,1217 @@ void loadSettings() {
   }
 }
 
-void connectWiFi() {
-  WiFi.mode(WIFI_STA);
-  WiFi.begin(WIFI_SSID, WIFI_PASS);
+uint32_t groupNow() {
+  return millis() + groupClockOffset;
+}
 
-  Serial.printf("[WiFi] Connecting to %s", WIFI_SSID);
-  uint8_t attempts = 0;
-  while (WiFi.status() != WL_CONNECTED && attempts < 40) {
-    delay(250);
-    Serial.print('.');
-    attempts++;
-  }
-  Serial.println();
+bool isGroupActive() {
+  return settings.groupId != GROUP_NONE && groupUdpStarted;
+}
 
-  if (WiFi.status() == WL_CONNECTED) {
-    Serial.printf("[WiFi] Connected. IP: %s\n", WiFi.localIP().toString().c_str());
-  } else {
-    Serial.println("[WiFi] Initial connection failed, retry will continue in loop()");
-  }
+// Shared start times only mean something once this member runs on the leader's clock.
+bool isGroupSynced() {
+  return isGroupActive() && groupClockSynced;
 }
 
-void initTimeSync() {
-  configTime(TZ_OFFSET_SECONDS, 0, "pool.ntp.org", "time.nist.gov", "time.google.com");
-  Serial.printf("[TIME] NTP sync configured (UTC%+d)\n", TIMEZONE_UTC_HOURS);
+bool isGroupPeerFresh(const GroupPeer &peer) {
+  return peer.nodeId != 0 && millis() - peer.lastSeenAt < GROUP_PEER_TIMEOUT_MS;
 }
 
-void maintainWiFi() {
-  if (WiFi.status() == WL_CONNECTED) {
-    return;
+// The member with the lowest chip id acts as the clock reference for the group.
+const GroupPeer *findGroupLeader() {
+  const GroupPeer *leader = nullptr;
+  for (const GroupPeer &peer : groupPeers) {
+    if (isGroupPeerFresh(peer) && peer.nodeId < groupNodeId && (leader == nullptr || peer.nodeId < leader->nodeId)) {
+      leader = &peer;
+    }
+  }
+  return leader;
+}
+
+uint8_t countGroupPeers() {
+  uint8_t count = 0;
+  for (const GroupPeer &peer : groupPeers) {
+    if (isGroupPeerFresh(peer)) {
+      count++;
+    }
   }
+  return count;
+}
 
-  if (millis() - lastWifiRetryAt < WIFI_RETRY_MS) {
+void rememberGroupPeer(uint32_t nodeId, const IPAddress &ip) {
+  GroupPeer *slot = nullptr;
+  for (GroupPeer &peer : groupPeers) {
+    if (peer.nodeId == nodeId) {
+      slot = &peer;
+      break;
+    }
+    if (slot == nullptr && !isGroupPeerFresh(peer)) {
+      slot = &peer;
+    }
+  }
+  if (slot == nullptr) {
     return;
   }
+  slot->nodeId = nodeId;
+  slot->ip = ip;
+  slot->lastSeenAt = millis();
+}
 
-  lastWifiRetryAt = millis();
-  Serial.println("[WiFi] Disconnected, trying reconnect...");
-  WiFi.disconnect();
-  WiFi.begin(WIFI_SSID, WIFI_PASS);
+void initGroupPacket(GroupPacket &packet, GroupPacketType type) {
+  memset(&packet, 0, sizeof(packet));
+  packet.magic = GROUP_PROTOCOL_MAGIC;
+  packet.version = GROUP_PROTOCOL_VERSION;
+  packet.type = type;
+  packet.groupId = settings.groupId;
+  packet.nodeId = groupNodeId;
+  packet.seq = ++groupSeq;
 }
 
-void initStrip() {
-  strip.begin();
-  strip.setBrightness(255);
-  strip.show();
-  applyStripState();
+void sendGroupMulticast(const GroupPacket &packet) {
+  groupUdp.beginPacketMulticast(GROUP_MULTICAST_IP, GROUP_UDP_PORT, WiFi.localIP());
+  groupUdp.write(reinterpret_cast<const uint8_t *>(&packet), sizeof(packet));
+  groupUdp.endPacket();
 }
 
-String getWifiStatusText() {
-  return WiFi.status() == WL_CONNECTED ? "connected" : "disconnected";
+void sendGroupUnicast(const GroupPacket &packet, const IPAddress &ip, uint16_t port) {
+  groupUdp.beginPacket(ip, port);
+  groupUdp.write(reinterpret_cast<const uint8_t *>(&packet), sizeof(packet));
+  groupUdp.endPacket();
 }
 
-bool getLocalTime(struct tm &info) {
-  time_t now = time(nullptr);
-  if (now < 1600000000) {
-    return false;
+void applyGroupState(const PendingGroupState &state) {
+  // Anchor transitions to the shared start time rather than to the moment this loop noticed it.
+  uint32_t localStartAt = state.startAt - groupClockOffset;
+
+  if ((state.flags & GROUP_STATE_CROSSFADE) != 0 &&
+      (state.brightness != settings.brightness || state.temperature != settings.temperature)) {
+    startColorCrossfade(localStartAt);
   }
-  localtime_r(&now, &info);
-  return true;
-}
 
-String formatTwoDigits(int value) {
-  if (value < 10) {
-    return "0" + String(value);
+  settings.brightness = state.brightness;
+  settings.temperature = state.temperature;
+  settings.power = state.power;
+  if (settings.power != lastPowerState) {
+    lastPowerState = settings.power;
+    startPowerFade(settings.power != 0 ? 255 : 0, localStartAt);
   }
-  return String(value);
-}
 
-String formatTime(uint8_t hour, uint8_t minute) {
-  return formatTwoDigits(hour) + ":" + formatTwoDigits(minute);
+  applyStripState();
+  requestSave();
 }
 
-bool isTimeInRange(uint8_t hour, uint8_t minute, uint8_t onHour, uint8_t onMinute, uint8_t offHour, uint8_t offMinute) {
-  int current = hour * 60 + minute;
-  int on = onHour * 60 + onMinute;
-  int off = offHour * 60 + offMinute;
+// One pending slot per member. A newer state that arrives while the slot is
+// still waiting keeps the earlier start time, so a stream of changes (a
+// slider drag) still lands every GROUP_START_DELAY_MS instead of never.
+void scheduleGroupState(const PendingGroupState &state) {
+  uint32_t startAt = state.startAt;
+  if (pendingGroupState.active && static_cast<int32_t>(startAt - pendingGroupState.startAt) > 0) {
+    startAt = pendingGroupState.startAt;
+  }
+  pendingGroupState = state;
+  pendingGroupState.startAt = startAt;
+  pendingGroupState.active = true;
+}
 
-  if (on == off) {
-    return false;
+// The state user changes build on: a group change waiting for its shared
+// start time has already been accepted even though it is not on the strip yet.
+PersistedSettings getAcceptedSettings() {
+  PersistedSettings accepted = settings;
+  if (pendingGroupState.active) {
+    accepted.brightness = pendingGroupState.brightness;
+    accepted.temperature = pendingGroupState.temperature;
+    accepted.power = pendingGroupState.power;
   }
+  return accepted;
+}
 
-  if (on < off) {
-    return current >= on && current < off;
+// Applies a waiting group change right away, for when its shared start time
+// can no longer be honored (leaving the group, losing the clock reference).
+void flushPendingGroupState() {
+  if (!pendingGroupState.active) {
+    return;
   }
+  pendingGroupState.active = false;
+  pendingGroupState.startAt = groupNow();
+  applyGroupState(pendingGroupState);
+}
 
-  return current >= on || current < off;
+void resetGroupClock() {
+  flushPendingGroupState();
+  groupClockSynced = false;
+  groupClockSampleCount = 0;
+  groupClockSampleNext = 0;
 }
 
-void applyScheduleIfNeeded() {
-  if (!settings.scheduleEnabled) {
+void applyPendingGroupStateIfDue() {
+  if (!pendingGroupState.active || static_cast<int32_t>(groupNow() - pendingGroupState.startAt) < 0) {
     return;
   }
+  pendingGroupState.active = false;
+  applyGroupState(pendingGroupState);
+}
 
-  if (millis() - lastScheduleCheckAt < SCHEDULE_CHECK_MS) {
-    return;
+void broadcastGroupState(const PersistedSettings &next, uint8_t flags) {
+  // Reuse the start time of a still-pending change so every member coalesces to the same moment.
+  uint32_t startAt = pendingGroupState.active ? pendingGroupState.startAt : groupNow() + GROUP_START_DELAY_MS;
+  PendingGroupState state = {true, startAt, next.brightness, next.temperature, next.power, flags};
+
+  GroupPacket packet;
+  initGroupPacket(packet, GROUP_PACKET_STATE);
+  packet.flags = flags;
+  packet.groupTime = state.startAt;
+  packet.brightness = state.brightness;
+  packet.temperature = state.temperature;
+  packet.power = state.power;
+
+  // UDP multicast has no retransmission; receivers drop the duplicate by sequence number.
+  for (uint8_t i = 0; i < GROUP_STATE_REPEATS; i++) {
+    sendGroupMulticast(packet);
   }
-  lastScheduleCheckAt = millis();
+  scheduleGroupState(state);
 
-  struct tm now{};
-  if (!getLocalTime(now)) {
+  Serial.printf("[GROUP] State brightness=%u temp=%u power=%u starts in %ums\n",
+                state.brightness,
+                state.temperature,
+                state.power,
+                GROUP_START_DELAY_MS);
+}
+
+void handleGroupClockResponse(const GroupPacket &packet) {
+  uint32_t receivedAt = millis();
+  uint32_t rtt = receivedAt - packet.t0;
+  if (packet.nodeId != groupClockReferenceId || rtt > GROUP_MAX_SYNC_RTT_MS) {
     return;
   }
 
-  bool shouldBeOn = isTimeInRange(
-      static_cast<uint8_t>(now.tm_hour),
-      static_cast<uint8_t>(now.tm_min),
-      settings.onHour,
-      settings.onMinute,
-      settings.offHour,
-      settings.offMinute);
+  // NTP-style estimate: the leader stamped its clock roughly half a round trip ago.
+  GroupClockSample &sample = groupClockSamples[groupClockSampleNext];
+  sample.rtt = rtt;
+  sample.offset = packet.groupTime + rtt / 2 - receivedAt;
+  groupClockSampleNext = static_cast<uint8_t>((groupClockSampleNext + 1) % GROUP_CLOCK_SAMPLES);
+  if (groupClockSampleCount < GROUP_CLOCK_SAMPLES) {
+    groupClockSampleCount++;
+  }
 
-  uint8_t target = shouldBeOn ? 1 : 0;
-  if (settings.power != target) {
-    settings.power = target;
-    applyStripState();
+  // The fastest recent round trip has the least queueing jitter, so trust it.
+  const GroupClockSample *best = &groupClockSamples[0];
+  for (uint8_t i = 1; i < groupClockSampleCount; i++) {
+    if (groupClockSamples[i].rtt < best->rtt) {
+      best = &groupClockSamples[i];
+    }
   }
+  groupClockOffset = best->offset;
+  groupLastSyncRtt = best->rtt;
+  groupClockSynced = true;
 }
 
-void handleButton() {
-  bool reading = digitalRead(BTN_PIN) == HIGH;
-  if (reading != buttonLastReading) {
-    buttonLastChangeAt = millis();
+void handleGroupPacket(const GroupPacket &packet, const IPAddress &remoteIp, uint16_t remotePort) {
+  if (packet.magic != GROUP_PROTOCOL_MAGIC || packet.version != GROUP_PROTOCOL_VERSION ||
+      packet.groupId != settings.groupId || packet.nodeId == groupNodeId) {
+    return;
   }
 
-  if (millis() - buttonLastChangeAt > BUTTON_DEBOUNCE_MS && reading != buttonStableState) {
-    buttonStableState = reading;
-    if (!buttonStableState) {
-      settings.power = settings.power ? 0 : 1;
-      applyStripState();
-      requestSave();
-    }
-  }
+  rememberGroupPeer(packet.nodeId, remoteIp);
 
-  buttonLastReading = reading;
-}
+  switch (packet.type) {
+    case GROUP_PACKET_CLOCK_REQUEST: {
+      // Requests may arrive by multicast; only the clock reference answers them.
+      if (findGroupLeader() != nullptr) {
+        return;
+      }
+      GroupPacket response;
+      initGroupPacket(response, GROUP_PACKET_CLOCK_RESPONSE);
+      response.t0 = packet.t0;
+      response.groupTime = groupNow();
+      sendGroupUnicast(response, remoteIp, remotePort);
+      break;
+    }
 
-void sendStateJson() {
-  struct tm now{};
-  String timeText = getLocalTime(now) ? (formatTwoDigits(now.tm_hour) + ":" + formatTwoDigits(now.tm_min)) : "--:--";
+    case GROUP_PACKET_CLOCK_RESPONSE:
+      handleGroupClockResponse(packet);
+      break;
 
-  String json = "{";
-  json += "\"brightness\":" + String(settings.brightness);
-  json += ",\"temperature\":" + String(settings.temperature);
-  json += ",\"on\":" + String(settings.power);
-  json += ",\"schedule\":" + String(settings.scheduleEnabled);
-  json += ",\"onTime\":\"" + formatTime(settings.onHour, settings.onMinute) + "\"";
-  json += ",\"offTime\":\"" + formatTime(settings.offHour, settings.offMinute) + "\"";
-  json += ",\"ip\":\"" + WiFi.localIP().toString() + "\"";
-  json += ",\"wifi\":\"" + getWifiStatusText() + "\"";
-  json += ",\"time\":\"" + timeText + "\"";
-  json += "}";
+    case GROUP_PACKET_STATE:
+      if (packet.nodeId == lastGroupStateNodeId && packet.seq == lastGroupStateSeq) {
+        return;
+      }
+      lastGroupStateNodeId = packet.nodeId;
+      lastGroupStateSeq = packet.seq;
+      if (packet.brightness > 100 || packet.temperature < KELVIN_MIN || packet.temperature > KELVIN_MAX || packet.power > 1) {
+        return;
+      }
+      {
+        PendingGroupState state = {true, packet.groupTime, packet.brightness, packet.temperature, packet.power, packet.flags};
+        // A start time far from the shared clock comes from a sender (or this member) that is not
+        // synced yet; holding it could stall the whole group, so apply such a state now.
+        int32_t startsIn = static_cast<int32_t>(state.startAt - groupNow());
+        if (!groupClockSynced || startsIn > static_cast<int32_t>(2 * GROUP_START_DELAY_MS) ||
+            startsIn < -static_cast<int32_t>(2 * GROUP_START_DELAY_MS)) {
+          state.startAt = groupNow();
+        }
+        scheduleGroupState(state);
+      }
+      break;
 
-  server.send(200, "application/json", json);
+    default:
+      break;
+  }
 }
 
-void handleRoot() {
-  server.send_P(200, "text/html; charset=utf-8", INDEX_HTML);
+void stopGroupUdp() {
+  if (!groupUdpStarted) {
+    return;
+  }
+  groupUdp.stop();
+  groupUdpStarted = false;
+  // A change already reported as accepted still reaches this member's strip.
+  resetGroupClock();
+  groupClockReferenceId = 0;
+  for (GroupPeer &peer : groupPeers) {
+    peer = {};
+  }
+  Serial.println("[GROUP] Left multicast group");
 }
 
-void handleState() {
-  sendStateJson();
-}
+void maintainGroup() {
+  if (settings.groupId == GROUP_NONE || WiFi.status() != WL_CONNECTED || groupUdpJoinedId != settings.groupId) {
+    stopGroupUdp();
+  }
+  if (settings.groupId == GROUP_NONE || WiFi.status() != WL_CONNECTED) {
+    return;
+  }
 
-void handleSet() {
-  if (server.hasArg("brightness")) {
+  if (!groupUdpStarted) {
+    if (groupJoinFailed && millis() - lastGroupJoinAttemptAt < WIFI_RETRY_MS) {
+      return;
+    }
+    lastGroupJoinAttemptAt = millis();
+    groupUdpStarted = groupUdp.beginMulticast(WiFi.localIP(), GROUP_MULTICAST_IP, GROUP_UDP_PORT) != 0;
+    groupUdpJoinedId = settings.groupId;
+    groupJoinFailed = !groupUdpStarted;
+    groupJoinedAt = millis();
+    Serial.printf("[GROUP] Join group %u as node %08x: %s\n",
+                  settings.groupId,
+                  groupNodeId,
+                  groupUdpStarted ? "OK" : "FAILED");
+    if (!groupUdpStarted) {
+      return;
+    }
+  }
+
+  for (uint8_t i = 0; i < GROUP_MAX_PACKETS_PER_LOOP; i++) {
+    int size = groupUdp.parsePacket();
+    if (size <= 0) {
+      break;
+    }
+    GroupPacket packet;
+    if (size != static_cast<int>(sizeof(packet)) ||
+        groupUdp.read(reinterpret_cast<uint8_t *>(&packet), sizeof(packet)) != static_cast<int>(sizeof(packet))) {
+      groupUdp.flush();
+      continue;
+    }
+    handleGroupPacket(packet, groupUdp.remoteIP(), groupUdp.remotePort());
+  }
+
+  if (millis() - lastGroupBeaconAt >= GROUP_BEACON_INTERVAL_MS) {
+    lastGroupBeaconAt = millis();
+
+    GroupPacket beacon;
+    initGroupPacket(beacon, GROUP_PACKET_BEACON);
+    beacon.groupTime = groupNow();
+    sendGroupMulticast(beacon);
+
+    const GroupPeer *leader = findGroupLeader();
+    if (leader != nullptr) {
+      // Samples against another leader's clock are worthless; start over.
+      if (groupClockReferenceId != leader->nodeId) {
+        resetGroupClock();
+        groupClockReferenceId = leader->nodeId;
+      }
+      GroupPacket request;
+      initGroupPacket(request, GROUP_PACKET_CLOCK_REQUEST);
+      request.t0 = millis();
+      sendGroupUnicast(request, leader->ip, GROUP_UDP_PORT);
+    } else if (groupClockSynced || millis() - groupJoinedAt >= GROUP_REFERENCE_GRACE_MS) {
+      // This node is the reference now; keep its clock continuous across leader changes.
+      // A fresh member first waits a few beacons for a lower id to show up.
+      groupClockReferenceId = groupNodeId;
+      groupClockSynced = true;
+    }
+  }
+
+  applyPendingGroupStateIfDue();
+}
+
+// Takes the non-visual fields of next and leaves what is on the strip alone.
+PersistedSettings withLiveLook(const PersistedSettings &next) {
+  PersistedSettings local = next;
+  local.brightness = settings.brightness;
+  local.temperature = settings.temperature;
+  local.power = settings.power;
+  return local;
+}
+
+// Single mutation path for user-initiated changes. Inside a group the visible
+// part of the change is deferred to a shared start time on every member.
+void commitSettings(const PersistedSettings &next, bool crossfade = false) {
+  PersistedSettings accepted = getAcceptedSettings();
+  bool lookChanged = next.brightness != accepted.brightness ||
+                     next.temperature != accepted.temperature ||
+                     next.power != accepted.power;
+
+  // A group switch is committed locally: this member has not joined the new group yet.
+  if (lookChanged && isGroupSynced() && next.groupId == settings.groupId) {
+    settings = withLiveLook(next);
+    broadcastGroupState(next, crossfade ? GROUP_STATE_CROSSFADE : 0);
+  } else if (!lookChanged && pendingGroupState.active) {
+    // Only schedule or group fields changed; the pending look still waits for its start time.
+    settings = withLiveLook(next);
+  } else {
+    // next already includes any pending group state, so this change supersedes it.
+    pendingGroupState.active = false;
+    if (crossfade) {
+      startColorCrossfade(millis());
+    }
+    settings = next;
+    applyStripState();
+  }
+
+  requestSave();
+}
+
+void loadPresets() {
+  EEPROM.get(PRESETS_EEPROM_OFFSET, presets);
+
+  uint8_t loadedCount = 0;
+  for (ScenePreset &preset : presets) {
+    bool isValid = preset.marker == PRESET_MARKER &&
+                   preset.brightness <= 100 &&
+                   preset.temperature >= KELVIN_MIN && preset.temperature <= KELVIN_MAX;
+    if (!isValid) {
+      preset = {};
+      continue;
+    }
+    preset.name[PRESET_NAME_LENGTH] = '\0';
+    loadedCount++;
+  }
+
+  Serial.printf("[PRESET] Loaded %u of %u presets\n", loadedCount, PRESET_COUNT);
+}
+
+bool isPresetStored(uint8_t id) {
+  return id < PRESET_COUNT && presets[id].marker == PRESET_MARKER;
+}
+
+uint8_t getActivePresetId() {
+  if (!isPresetStored(activePresetId)) {
+    return PRESET_NONE;
+  }
+
+  const ScenePreset &preset = presets[activePresetId];
+  PersistedSettings accepted = getAcceptedSettings();
+  if (preset.brightness != accepted.brightness || preset.temperature != accepted.temperature) {
+    return PRESET_NONE;
+  }
+  return activePresetId;
+}
+
+void storePreset(uint8_t id, const char *name) {
+  // Inside a group the look the user just chose may still wait for its start time.
+  PersistedSettings accepted = getAcceptedSettings();
+  ScenePreset &preset = presets[id];
+  preset = {};
+  preset.marker = PRESET_MARKER;
+  preset.brightness = accepted.brightness;
+  preset.temperature = accepted.temperature;
+  resolveColor(accepted.brightness, accepted.temperature, preset.r, preset.g, preset.b);
+
+  // Names end up in JSON verbatim, so keep only printable ASCII without quotes.
+  uint8_t length = 0;
+  for (const char *p = name; *p != '\0' && length < PRESET_NAME_LENGTH; p++) {
+    if (*p >= 0x20 && *p < 0x7F && *p != '"' && *p != '\\') {
+      preset.name[length++] = *p;
+    }
+  }
+  if (length == 0) {
+    snprintf(preset.name, sizeof(preset.name), "Preset %u", id + 1);
+  }
+
+  activePresetId = id;
+  requestSave();
+  Serial.printf("[PRESET] Stored #%u \"%s\" RGB=(%u,%u,%u)\n", id, preset.name, preset.r, preset.g, preset.b);
+}
+
+void deletePreset(uint8_t id) {
+  presets[id] = {};
+  if (activePresetId == id) {
+    activePresetId = PRESET_NONE;
+  }
+  requestSave();
+}
+
+bool recallPreset(uint8_t id) {
+  if (!isPresetStored(id)) {
+    return false;
+  }
+
+  const ScenePreset &preset = presets[id];
+  PersistedSettings next = getAcceptedSettings();
+  next.brightness = preset.brightness;
+  next.temperature = preset.temperature;
+  next.power = 1;
+  resolvedColor = {true, preset.brightness, preset.temperature, preset.r, preset.g, preset.b};
+  activePresetId = id;
+
+  commitSettings(next, true);
+  return true;
+}
+
+bool recallNextPreset() {
+  uint8_t start = activePresetId < PRESET_COUNT ? activePresetId : PRESET_COUNT - 1;
+  for (uint8_t step = 1; step <= PRESET_COUNT; step++) {
+    uint8_t id = static_cast<uint8_t>((start + step) % PRESET_COUNT);
+    if (isPresetStored(id)) {
+      return recallPreset(id);
+    }
+  }
+  return false;
+}
+
+void connectWiFi() {
+  WiFi.mode(WIFI_STA);
+  WiFi.begin(WIFI_SSID, WIFI_PASS);
+
+  Serial.printf("[WiFi] Connecting to %s", WIFI_SSID);
+  uint8_t attempts = 0;
+  while (WiFi.status() != WL_CONNECTED && attempts < 40) {
+    delay(250);
+    Serial.print('.');
+    attempts++;
+  }
+  Serial.println();
+
+  if (WiFi.status() == WL_CONNECTED) {
+    Serial.printf("[WiFi] Connected. IP: %s\n", WiFi.localIP().toString().c_str());
+  } else {
+    Serial.println("[WiFi] Initial connection failed, retry will continue in loop()");
+  }
+}
+
+void initTimeSync() {
+  configTime(TZ_OFFSET_SECONDS, 0, "pool.ntp.org", "time.nist.gov", "time.google.com");
+  Serial.printf("[TIME] NTP sync configured (UTC%+d)\n", TIMEZONE_UTC_HOURS);
+}
+
+void maintainWiFi() {
+  if (WiFi.status() == WL_CONNECTED) {
+    return;
+  }
+
+  if (millis() - lastWifiRetryAt < WIFI_RETRY_MS) {
+    return;
+  }
+
+  lastWifiRetryAt = millis();
+  Serial.println("[WiFi] Disconnected, trying reconnect...");
+  WiFi.disconnect();
+  WiFi.begin(WIFI_SSID, WIFI_PASS);
+}
+
+void initStrip() {
+  strip.begin();
+  strip.setBrightness(255);
+  strip.show();
+  applyStripState();
+}
+
+String getWifiStatusText() {
+  return WiFi.status() == WL_CONNECTED ? "connected" : "disconnected";
+}
+
+bool getLocalTime(struct tm &info) {
+  time_t now = time(nullptr);
+  if (now < 1600000000) {
+    return false;
+  }
+  localtime_r(&now, &info);
+  return true;
+}
+
+String formatTwoDigits(int value) {
+  if (value < 10) {
+    return "0" + String(value);
+  }
+  return String(value);
+}
+
+String formatTime(uint8_t hour, uint8_t minute) {
+  return formatTwoDigits(hour) + ":" + formatTwoDigits(minute);
+}
+
+bool isTimeInRange(uint8_t hour, uint8_t minute, uint8_t onHour, uint8_t onMinute, uint8_t offHour, uint8_t offMinute) {
+  int current = hour * 60 + minute;
+  int on = onHour * 60 + onMinute;
+  int off = offHour * 60 + offMinute;
+
+  if (on == off) {
+    return false;
+  }
+
+  if (on < off) {
+    return current >= on && current < off;
+  }
+
+  return current >= on || current < off;
+}
+
+void writeEnergySnapshot() {
+  sealEnergyLog();
+  ESP.rtcUserMemoryWrite(ENERGY_RTC_BLOCK, reinterpret_cast<uint32_t *>(&energyLog), sizeof(energyLog));
+}
+
+// RTC memory carries the log across resets with minute resolution; the
+// EEPROM copy, written when an hour that used energy rolls over, covers power loss.
+void loadEnergyLog() {
+  EnergyLog loaded{};
+  ESP.rtcUserMemoryRead(ENERGY_RTC_BLOCK, reinterpret_cast<uint32_t *>(&loaded), sizeof(loaded));
+  const char *source = "RTC";
+  if (!isEnergyLogValid(loaded)) {
+    EEPROM.get(ENERGY_EEPROM_OFFSET, loaded);
+    source = "EEPROM";
+  }
+
+  if (isEnergyLogValid(loaded)) {
+    energyLog = loaded;
+    Serial.printf("[ENERGY] Restored from %s: total=%umAh\n", source, energyLog.totalMah);
+  } else {
+    energyLog = {};
+    energyLog.magic = ENERGY_MAGIC;
+    Serial.println("[ENERGY] No saved log, starting empty");
+  }
+  energyHourStartedAt = millis();
+  energyIntegratedAt = millis();
+}
+
+void advanceEnergyHour(uint32_t targetHour) {
+  // A dark hour adds nothing to persist, so it is not worth a flash sector erase.
+  bool hourAccrued = energyLog.hours[energyLog.hourIndex % ENERGY_HOUR_BUCKETS] != 0;
+
+  // Clear every bucket the device was not running for, but never more than a full ring.
+  uint32_t steps = targetHour - energyLog.hourIndex;
+  if (steps > static_cast<uint32_t>(ENERGY_DAY_BUCKETS) * 24) {
+    steps = static_cast<uint32_t>(ENERGY_DAY_BUCKETS) * 24;
+    energyLog.hourIndex = targetHour - steps;
+  }
+  for (uint32_t i = 0; i < steps; i++) {
+    uint32_t previousDay = energyLog.hourIndex / 24;
+    energyLog.hourIndex++;
+    energyLog.hours[energyLog.hourIndex % ENERGY_HOUR_BUCKETS] = 0;
+    if (energyLog.hourIndex / 24 != previousDay) {
+      energyLog.days[(energyLog.hourIndex / 24) % ENERGY_DAY_BUCKETS] = 0;
+    }
+  }
+  energyHourStartedAt = millis();
+  if (hourAccrued) {
+    requestSave();
+  }
+}
+
+// A log started without NTP counts hours from zero. Once the clock is known,
+// its running hour and day move to their wall-clock slots; earlier uptime
+// hours cannot be placed and are dropped.
+void anchorEnergyLog(uint32_t hourIndex) {
+  uint16_t currentHour = energyLog.hours[energyLog.hourIndex % ENERGY_HOUR_BUCKETS];
+  uint16_t currentDay = energyLog.days[(energyLog.hourIndex / 24) % ENERGY_DAY_BUCKETS];
+  memset(energyLog.hours, 0, sizeof(energyLog.hours));
+  memset(energyLog.days, 0, sizeof(energyLog.days));
+  energyLog.hourIndex = hourIndex;
+  energyLog.hours[hourIndex % ENERGY_HOUR_BUCKETS] = currentHour;
+  energyLog.days[(hourIndex / 24) % ENERGY_DAY_BUCKETS] = currentDay;
+  energyHourStartedAt = millis();
+  requestSave();
+}
+
+bool getLocalHourIndex(uint32_t &hourIndex) {
+  time_t now = time(nullptr);
+  if (now < 1600000000) {
+    return false;
+  }
+  hourIndex = static_cast<uint32_t>((now + TZ_OFFSET_SECONDS) / 3600);
+  return true;
+}
+
+void updateEnergyAccounting() {
+  if (millis() - lastEnergyTickAt < ENERGY_TICK_MS) {
+    return;
+  }
+  lastEnergyTickAt = millis();
+
+  // A static strip is rendered once, so the running frame is integrated here as well.
+  accountEnergy(energyCurrentMa);
+
+  uint32_t hourIndex = 0;
+  if (getLocalHourIndex(hourIndex)) {
+    // Wall-clock hour numbers are far above anything an uptime count reaches.
+    if (!energyClockAnchored && energyLog.hourIndex < 24 * 365) {
+      anchorEnergyLog(hourIndex);
+    }
+    energyClockAnchored = true;
+    if (hourIndex > energyLog.hourIndex) {
+      advanceEnergyHour(hourIndex);
+    }
+  } else if (millis() - energyHourStartedAt >= MS_PER_HOUR) {
+    // Without NTP the buckets still roll, just not on wall-clock boundaries.
+    advanceEnergyHour(energyLog.hourIndex + 1);
+  }
+
+  if (millis() - lastEnergySnapshotAt >= ENERGY_RTC_SNAPSHOT_MS) {
+    lastEnergySnapshotAt = millis();
+    writeEnergySnapshot();
+  }
+}
+
+void applyScheduleIfNeeded() {
+  if (!settings.scheduleEnabled) {
+    return;
+  }
+
+  if (millis() - lastScheduleCheckAt < SCHEDULE_CHECK_MS) {
+    return;
+  }
+  lastScheduleCheckAt = millis();
+
+  struct tm now{};
+  if (!getLocalTime(now)) {
+    return;
+  }
+
+  bool shouldBeOn = isTimeInRange(
+      static_cast<uint8_t>(now.tm_hour),
+      static_cast<uint8_t>(now.tm_min),
+      settings.onHour,
+      settings.onMinute,
+      settings.offHour,
+      settings.offMinute);
+
+  // Goes through commitSettings so group members switch together; a member whose
+  // timer fires after a peer's already sees the change as accepted and stays quiet.
+  PersistedSettings next = getAcceptedSettings();
+  uint8_t target = shouldBeOn ? 1 : 0;
+  if (next.power != target) {
+    next.power = target;
+    commitSettings(next);
+  }
+}
+
+void togglePower() {
+  PersistedSettings next = getAcceptedSettings();
+  next.power = next.power ? 0 : 1;
+  commitSettings(next);
+}
+
+void handleButton() {
+  bool reading = digitalRead(BTN_PIN) == HIGH;
+  if (reading != buttonLastReading) {
+    buttonLastChangeAt = millis();
+  }
+
+  if (millis() - buttonLastChangeAt > BUTTON_DEBOUNCE_MS && reading != buttonStableState) {
+    buttonStableState = reading;
+    if (!buttonStableState) {
+      buttonPressedAt = millis();
+      buttonLongPressHandled = false;
+    } else if (!buttonLongPressHandled) {
+      togglePower();
+    }
+  }
+
+  // Long press cycles through stored presets; without presets it behaves like a short press.
+  if (!buttonStableState && !buttonLongPressHandled && millis() - buttonPressedAt >= BUTTON_LONG_PRESS_MS) {
+    buttonLongPressHandled = true;
+    if (!recallNextPreset()) {
+      togglePower();
+    }
+  }
+
+  buttonLastReading = reading;
+}
+
+bool isBatchSpace(char c) {
+  return c == ' ' || c == '\t' || c == '\r';
+}
+
+void trimToken(const char *&begin, const char *&end) {
+  while (begin < end && isBatchSpace(*begin)) {
+    begin++;
+  }
+  while (end > begin && isBatchSpace(*(end - 1))) {
+    end--;
+  }
+}
+
+bool tokenEquals(const char *begin, const char *end, const char *literal) {
+  size_t length = static_cast<size_t>(end - begin);
+  return strlen(literal) == length && strncmp(begin, literal, length) == 0;
+}
+
+bool parseUnsignedToken(const char *begin, const char *end, uint32_t &out) {
+  // Five digits are enough for every field and keep the accumulator far from overflow.
+  if (begin == end || end - begin > 5) {
+    return false;
+  }
+
+  uint32_t value = 0;
+  for (const char *p = begin; p < end; p++) {
+    if (*p < '0' || *p > '9') {
+      return false;
+    }
+    value = value * 10 + static_cast<uint32_t>(*p - '0');
+  }
+  out = value;
+  return true;
+}
+
+BatchError parseClockToken(const char *begin, const char *end, uint8_t &hour, uint8_t &minute) {
+  const char *sep = static_cast<const char *>(memchr(begin, ':', static_cast<size_t>(end - begin)));
+  uint32_t h = 0;
+  uint32_t m = 0;
+  if (sep == nullptr || !parseUnsignedToken(begin, sep, h) || !parseUnsignedToken(sep + 1, end, m)) {
+    return BatchError::BadValue;
+  }
+  if (h >= 24 || m >= 60) {
+    return BatchError::OutOfRange;
+  }
+  hour = static_cast<uint8_t>(h);
+  minute = static_cast<uint8_t>(m);
+  return BatchError::None;
+}
+
+uint8_t findBatchField(const char *begin, const char *end) {
+  for (uint8_t i = 0; i < BATCH_FIELD_COUNT; i++) {
+    if (tokenEquals(begin, end, BATCH_FIELD_NAMES[i])) {
+      return i;
+    }
+  }
+  return BATCH_FIELD_UNKNOWN;
+}
+
+BatchError applyBatchField(PersistedSettings &staged, uint8_t field, const char *begin, const char *end) {
+  uint32_t value = 0;
+
+  switch (field) {
+    case BATCH_FIELD_BRIGHTNESS:
+      if (!parseUnsignedToken(begin, end, value)) {
+        return BatchError::BadValue;
+      }
+      if (value > 100) {
+        return BatchError::OutOfRange;
+      }
+      staged.brightness = static_cast<uint8_t>(value);
+      return BatchError::None;
+
+    case BATCH_FIELD_TEMPERATURE:
+      if (!parseUnsignedToken(begin, end, value)) {
+        return BatchError::BadValue;
+      }
+      if (value < KELVIN_MIN || value > KELVIN_MAX) {
+        return BatchError::OutOfRange;
+      }
+      staged.temperature = static_cast<uint16_t>(value);
+      return BatchError::None;
+
+    case BATCH_FIELD_ON:
+    case BATCH_FIELD_SCHEDULE:
+      if (!parseUnsignedToken(begin, end, value)) {
+        return BatchError::BadValue;
+      }
+      if (value > 1) {
+        return BatchError::OutOfRange;
+      }
+      if (field == BATCH_FIELD_ON) {
+        staged.power = static_cast<uint8_t>(value);
+      } else {
+        staged.scheduleEnabled = static_cast<uint8_t>(value);
+      }
+      return BatchError::None;
+
+    case BATCH_FIELD_ON_TIME:
+      return parseClockToken(begin, end, staged.onHour, staged.onMinute);
+
+    case BATCH_FIELD_OFF_TIME:
+      return parseClockToken(begin, end, staged.offHour, staged.offMinute);
+
+    case BATCH_FIELD_GROUP:
+      if (!parseUnsignedToken(begin, end, value)) {
+        return BatchError::BadValue;
+      }
+      if (value >= 0xFF) {
+        return BatchError::OutOfRange;
+      }
+      staged.groupId = static_cast<uint8_t>(value);
+      return BatchError::None;
+
+    default:
+      return BatchError::UnknownKey;
+  }
+}
+
+void recordBatchError(CommandBatch &batch, uint8_t field, BatchError error) {
+  if (batch.errorCount >= MAX_BATCH_ERRORS) {
+    batch.errorsTruncated = true;
+    return;
+  }
+  batch.errors[batch.errorCount++] = {batch.commandCount, field, error};
+}
+
+// Parses "key=value" commands separated by ';' or newlines directly from the
+// request body. Values are validated into batch.staged; nothing touches the
+// live settings, so the caller can apply the whole batch or none of it.
+void parseCommandBatch(const char *text, size_t length, CommandBatch &batch) {
+  const char *cursor = text;
+  const char *limit = text + length;
+
+  while (cursor < limit) {
+    const char *commandEnd = cursor;
+    while (commandEnd < limit && *commandEnd != ';' && *commandEnd != '\n') {
+      commandEnd++;
+    }
+
+    const char *begin = cursor;
+    const char *end = commandEnd;
+    cursor = commandEnd + 1;
+    trimToken(begin, end);
+    if (begin == end) {
+      continue;
+    }
+
+    if (batch.commandCount >= MAX_BATCH_COMMANDS) {
+      recordBatchError(batch, BATCH_FIELD_UNKNOWN, BatchError::TooMany);
+      return;
+    }
+
+    const char *eq = static_cast<const char *>(memchr(begin, '=', static_cast<size_t>(end - begin)));
+    if (eq == nullptr) {
+      recordBatchError(batch, BATCH_FIELD_UNKNOWN, BatchError::Syntax);
+      batch.commandCount++;
+      continue;
+    }
+
+    const char *keyBegin = begin;
+    const char *keyEnd = eq;
+    const char *valueBegin = eq + 1;
+    const char *valueEnd = end;
+    trimToken(keyBegin, keyEnd);
+    trimToken(valueBegin, valueEnd);
+
+    uint8_t field = findBatchField(keyBegin, keyEnd);
+    BatchError error = field == BATCH_FIELD_UNKNOWN
+                           ? BatchError::UnknownKey
+                           : applyBatchField(batch.staged, field, valueBegin, valueEnd);
+    if (error != BatchError::None) {
+      recordBatchError(batch, field, error);
+    }
+    batch.commandCount++;
+  }
+}
+
+const char *getBatchErrorText(BatchError error) {
+  switch (error) {
+    case BatchError::Syntax:
+      return "syntax";
+    case BatchError::UnknownKey:
+      return "unknown_key";
+    case BatchError::BadValue:
+      return "bad_value";
+    case BatchError::OutOfRange:
+      return "out_of_range";
+    case BatchError::TooMany:
+      return "too_many_commands";
+    default:
+      return "none";
+  }
+}
+
+bool isMqttEnabled() {
+  return MQTT_HOST[0] != '\0';
+}
+
+void formatMqttTopic(char *topic, size_t size, const char *suffix) {
+  snprintf(topic, size, "%s/%s", mqttBaseTopic, suffix);
+}
+
+bool publishMqtt(const char *suffix, const char *payload, bool retained = true) {
+  char topic[MQTT_TOPIC_LENGTH + 16];
+  formatMqttTopic(topic, sizeof(topic), suffix);
+  bool sent = mqttClient.publish(topic, 0, retained, payload) != 0;
+  if (sent) {
+    mqttStats.published++;
+  }
+  return sent;
+}
+
+void publishMqttDiscovery() {
+  char topic[64];
+  snprintf(topic, sizeof(topic), "homeassistant/light/%s/config", mqttClientId);
+
+  String json = "{";
+  json += "\"~\":\"" + String(mqttBaseTopic) + "\"";
+  json += ",\"name\":null";
+  json += ",\"uniq_id\":\"" + String(mqttClientId) + "\"";
+  json += ",\"avty_t\":\"~/availability\"";
+  json += ",\"cmd_t\":\"~/power/set\",\"stat_t\":\"~/power\"";
+  json += ",\"bri_cmd_t\":\"~/brightness/set\",\"bri_stat_t\":\"~/brightness\",\"bri_scl\":100";
+  json += ",\"clr_temp_cmd_t\":\"~/temperature/set\",\"clr_temp_stat_t\":\"~/temperature\"";
+  json += ",\"color_temp_kelvin\":true";
+  json += ",\"min_kelvin\":" + String(KELVIN_MIN);
+  json += ",\"max_kelvin\":" + String(KELVIN_MAX);
+  json += ",\"dev\":{\"ids\":[\"" + String(mqttClientId) + "\"],\"name\":\"Light ESP " + String(groupNodeId, HEX) + "\",\"mdl\":\"WS2812 ESP8266\"}";
+  json += "}";
+
+  sampleHeapLowWater();
+  if (mqttClient.publish(topic, 0, true, json.c_str()) != 0) {
+    mqttStats.published++;
+  }
+}
+
+// Publishes retained state only when it changed, and no more often than
+// MQTT_PUBLISH_MIN_INTERVAL_MS so slider drags collapse into a few messages.
+void publishMqttStateIfNeeded() {
+  bool changed = !mqttPublished.valid ||
+                 mqttPublished.brightness != settings.brightness ||
+                 mqttPublished.temperature != settings.temperature ||
+                 mqttPublished.power != settings.power;
+  if (!changed || millis() - lastMqttPublishAt < MQTT_PUBLISH_MIN_INTERVAL_MS) {
+    return;
+  }
+  lastMqttPublishAt = millis();
+
+  char payload[8];
+  if (!mqttPublished.valid || mqttPublished.power != settings.power) {
+    publishMqtt("power", settings.power != 0 ? "ON" : "OFF");
+  }
+  if (!mqttPublished.valid || mqttPublished.brightness != settings.brightness) {
+    snprintf(payload, sizeof(payload), "%u", settings.brightness);
+    publishMqtt("brightness", payload);
+  }
+  if (!mqttPublished.valid || mqttPublished.temperature != settings.temperature) {
+    snprintf(payload, sizeof(payload), "%u", settings.temperature);
+    publishMqtt("temperature", payload);
+  }
+
+  mqttPublished = {true, settings.brightness, settings.temperature, settings.power};
+}
+
+bool payloadEquals(const char *payload, size_t length, const char *literal) {
+  return tokenEquals(payload, payload + length, literal);
+}
+
+void handleMqttMessage(const char *suffix, const char *payload, size_t length) {
+  // Single-field topics are rewritten into batch syntax so every command
+  // goes through the same validation as /api/batch.
+  char command[MQTT_COMMAND_LENGTH];
+  const char *text = payload;
+  size_t textLength = length;
+  if (strcmp(suffix, "power/set") == 0) {
+    bool on = payloadEquals(payload, length, "ON") || payloadEquals(payload, length, "1");
+    bool off = payloadEquals(payload, length, "OFF") || payloadEquals(payload, length, "0");
+    if (!on && !off) {
+      mqttStats.rejected++;
+      return;
+    }
+    textLength = static_cast<size_t>(snprintf(command, sizeof(command), "on=%u", on ? 1 : 0));
+    text = command;
+  } else if (strcmp(suffix, "brightness/set") == 0 || strcmp(suffix, "temperature/set") == 0) {
+    size_t keyLength = static_cast<size_t>(strchr(suffix, '/') - suffix);
+    if (length + keyLength + 2 > sizeof(command)) {
+      mqttStats.rejected++;
+      return;
+    }
+    memcpy(command, suffix, keyLength);
+    command[keyLength] = '=';
+    memcpy(command + keyLength + 1, payload, length);
+    textLength = keyLength + 1 + length;
+    text = command;
+  } else if (strcmp(suffix, "set") != 0) {
+    return;
+  }
+
+  CommandBatch batch{};
+  batch.staged = getAcceptedSettings();
+  parseCommandBatch(text, textLength, batch);
+  if (batch.errorCount > 0) {
+    mqttStats.rejected++;
+    Serial.printf("[MQTT] Rejected command on %s/%s: %s\n", mqttBaseTopic, suffix, getBatchErrorText(batch.errors[0].error));
+    return;
+  }
+  commitSettings(batch.staged);
+}
+
+// Runs in the TCP stack's context: copy and return.
+void onMqttMessage(char *topic, char *payload, AsyncMqttClientMessageProperties properties, size_t length, size_t index, size_t total) {
+  (void)properties;
+  mqttStats.received++;
+
+  size_t baseLength = strlen(mqttBaseTopic);
+  if (strncmp(topic, mqttBaseTopic, baseLength) != 0 || topic[baseLength] != '/') {
+    return;
+  }
+  const char *suffix = topic + baseLength + 1;
+  uint8_t next = static_cast<uint8_t>((mqttInboxHead + 1) % MQTT_INBOX_SIZE);
+  // Commands are short; anything split across TCP segments or longer than a batch line is not one.
+  if (index != 0 || length != total || total > MQTT_COMMAND_LENGTH ||
+      strlen(suffix) >= MQTT_SUFFIX_LENGTH || next == mqttInboxTail) {
+    mqttStats.rejected++;
+    return;
+  }
+
+  MqttInboxMessage &message = mqttInbox[mqttInboxHead];
+  strcpy(message.suffix, suffix);
+  memcpy(message.payload, payload, length);
+  message.length = static_cast<uint8_t>(length);
+  mqttInboxHead = next;
+}
+
+void onMqttConnect(bool sessionPresent) {
+  (void)sessionPresent;
+  mqttConnecting = false;
+  mqttSessionStarted = true;
+}
+
+void onMqttDisconnect(AsyncMqttClientDisconnectReason reason) {
+  if (mqttConnecting) {
+    mqttStats.failedConnects++;
+    mqttRetryDelayMs = mqttRetryDelayMs * 2 > MQTT_RETRY_MAX_MS ? MQTT_RETRY_MAX_MS : mqttRetryDelayMs * 2;
+  }
+  mqttConnecting = false;
+  Serial.printf("[MQTT] Disconnected (reason=%u), retry in %us\n", static_cast<uint8_t>(reason), mqttRetryDelayMs / 1000);
+}
+
+void initMqtt() {
+  if (!isMqttEnabled()) {
+    Serial.println("[MQTT] Disabled (MQTT_HOST not set)");
+    return;
+  }
+
+  snprintf(mqttClientId, sizeof(mqttClientId), "light_esp_%06x", groupNodeId);
+  snprintf(mqttBaseTopic, sizeof(mqttBaseTopic), "light_esp/%06x", groupNodeId);
+  formatMqttTopic(mqttWillTopic, sizeof(mqttWillTopic), "availability");
+
+  // The client keeps these pointers, so they all refer to static storage.
+  mqttClient.setServer(MQTT_HOST, MQTT_PORT);
+  mqttClient.setClientId(mqttClientId);
+  mqttClient.setKeepAlive(MQTT_KEEPALIVE_S);
+  mqttClient.setWill(mqttWillTopic, 0, true, "offline");
+  if (MQTT_USER[0] != '\0') {
+    mqttClient.setCredentials(MQTT_USER, MQTT_PASS[0] != '\0' ? MQTT_PASS : nullptr);
+  }
+  mqttClient.onConnect(onMqttConnect);
+  mqttClient.onDisconnect(onMqttDisconnect);
+  mqttClient.onMessage(onMqttMessage);
+  Serial.printf("[MQTT] Broker %s:%u, topic %s\n", MQTT_HOST, MQTT_PORT, mqttBaseTopic);
+}
+
+void startMqttSession() {
+  mqttStats.connects++;
+  mqttRetryDelayMs = MQTT_RETRY_MIN_MS;
+
+  char topic[MQTT_TOPIC_LENGTH + 16];
+  formatMqttTopic(topic, sizeof(topic), "set");
+  mqttClient.subscribe(topic, 0);
+  formatMqttTopic(topic, sizeof(topic), "+/set");
+  mqttClient.subscribe(topic, 0);
+  publishMqtt("availability", "online");
+  publishMqttDiscovery();
+  mqttPublished.valid = false;
+  Serial.println("[MQTT] Connected");
+}
+
+void maintainMqtt() {
+  if (!isMqttEnabled() || WiFi.status() != WL_CONNECTED) {
+    return;
+  }
+
+  uint32_t startedAt = micros();
+
+  // DNS, TCP and CONNACK all complete in callbacks, so an attempt costs
+  // loop() only the call that starts it. Attempts back off while the broker is away.
+  if (!mqttClient.connected()) {
+    if (mqttConnecting) {
+      // A lookup that never answers leaves the client waiting; give up on the attempt.
+      if (millis() - lastMqttAttemptAt >= MQTT_CONNECT_TIMEOUT_MS) {
+        mqttClient.disconnect(true);
+        if (mqttConnecting) {
+          onMqttDisconnect(AsyncMqttClientDisconnectReason::TCP_DISCONNECTED);
+        }
+        lastMqttAttemptAt = millis();
+      }
+      return;
+    }
+    if (millis() - lastMqttAttemptAt < mqttRetryDelayMs) {
+      return;
+    }
+    lastMqttAttemptAt = millis();
+    mqttConnecting = true;
+    mqttClient.connect();
+    return;
+  }
+
+  if (mqttSessionStarted) {
+    mqttSessionStarted = false;
+    startMqttSession();
+  }
+  while (mqttInboxTail != mqttInboxHead) {
+    MqttInboxMessage &message = mqttInbox[mqttInboxTail];
+    handleMqttMessage(message.suffix, message.payload, message.length);
+    mqttInboxTail = static_cast<uint8_t>((mqttInboxTail + 1) % MQTT_INBOX_SIZE);
+  }
+  publishMqttStateIfNeeded();
+
+  uint32_t spentUs = micros() - startedAt;
+  mqttStats.loopCalls++;
+  mqttStats.loopTotalUs += spentUs;
+  if (spentUs > mqttStats.loopMaxUs) {
+    mqttStats.loopMaxUs = spentUs;
+  }
+}
+
+void sendStateJson() {
+  struct tm now{};
+  String timeText = getLocalTime(now) ? (formatTwoDigits(now.tm_hour) + ":" + formatTwoDigits(now.tm_min)) : "--:--";
+
+  PersistedSettings accepted = getAcceptedSettings();
+  String json = "{";
+  json += "\"brightness\":" + String(accepted.brightness);
+  json += ",\"temperature\":" + String(accepted.temperature);
+  json += ",\"on\":" + String(accepted.power);
+  json += ",\"schedule\":" + String(settings.scheduleEnabled);
+  json += ",\"onTime\":\"" + formatTime(settings.onHour, settings.onMinute) + "\"";
+  json += ",\"offTime\":\"" + formatTime(settings.offHour, settings.offMinute) + "\"";
+  json += ",\"ip\":\"" + WiFi.localIP().toString() + "\"";
+  json += ",\"wifi\":\"" + getWifiStatusText() + "\"";
+  json += ",\"time\":\"" + timeText + "\"";
+  uint8_t presetId = getActivePresetId();
+  json += ",\"group\":" + String(settings.groupId);
+  json += ",\"preset\":" + (presetId == PRESET_NONE ? String("-1") : String(presetId));
+  json += "}";
+
+  sampleHeapLowWater();
+  server.send(200, "application/json", json);
+}
+
+void handleRoot() {
+  server.send_P(200, "text/html; charset=utf-8", INDEX_HTML);
+}
+
+void handleState() {
+  sendStateJson();
+}
+
+void handleSet() {
+  PersistedSettings next = getAcceptedSettings();
+
+  if (server.hasArg("brightness")) {
     int value = server.arg("brightness").toInt();
     if (value < 0) {
       value = 0;
@@ -714,7 +2219,7 @@ void handleSet() {
     if (value > 100) {
       value = 100;
     }
-    settings.brightness = static_cast<uint8_t>(value);
+    next.brightness = static_cast<uint8_t>(value);
   }
 
   if (server.hasArg("temperature")) {
@@ -725,15 +2230,15 @@ void handleSet() {
     if (value > KELVIN_MAX) {
       value = KELVIN_MAX;
     }
-    settings.temperature = static_cast<uint16_t>(value);
+    next.temperature = static_cast<uint16_t>(value);
   }
 
   if (server.hasArg("on")) {
-    settings.power = server.arg("on").toInt() != 0 ? 1 : 0;
+    next.power = server.arg("on").toInt() != 0 ? 1 : 0;
   }
 
   if (server.hasArg("schedule")) {
-    settings.scheduleEnabled = server.arg("schedule").toInt() != 0 ? 1 : 0;
+    next.scheduleEnabled = server.arg("schedule").toInt() != 0 ? 1 : 0;
   }
 
   if (server.hasArg("onTime")) {
@@ -743,8 +2248,8 @@ void handleSet() {
       int h = timeStr.substring(0, sep).toInt();
       int m = timeStr.substring(sep + 1).toInt();
       if (h >= 0 && h < 24 && m >= 0 && m < 60) {
-        settings.onHour = static_cast<uint8_t>(h);
-        settings.onMinute = static_cast<uint8_t>(m);
+        next.onHour = static_cast<uint8_t>(h);
+        next.onMinute = static_cast<uint8_t>(m);
       }
     }
   }
@@ -756,21 +2261,482 @@ void handleSet() {
       int h = timeStr.substring(0, sep).toInt();
       int m = timeStr.substring(sep + 1).toInt();
       if (h >= 0 && h < 24 && m >= 0 && m < 60) {
-        settings.offHour = static_cast<uint8_t>(h);
-        settings.offMinute = static_cast<uint8_t>(m);
+        next.offHour = static_cast<uint8_t>(h);
+        next.offMinute = static_cast<uint8_t>(m);
       }
     }
   }
 
-  applyStripState();
-  requestSave();
+  if (server.hasArg("group")) {
+    int value = server.arg("group").toInt();
+    if (value >= 0 && value < 0xFF) {
+      next.groupId = static_cast<uint8_t>(value);
+    }
+  }
+
+  commitSettings(next);
+  sendStateJson();
+}
+
+void handleBatch() {
+  if (!server.hasArg("plain")) {
+    server.send(400, "application/json", "{\"error\":\"empty_body\"}");
+    return;
+  }
+
+  const String &body = server.arg("plain");
+  CommandBatch batch{};
+  batch.staged = getAcceptedSettings();
+  parseCommandBatch(body.c_str(), body.length(), batch);
+
+  if (batch.errorCount > 0) {
+    String json = "{\"error\":\"invalid_batch\",\"errors\":[";
+    for (uint8_t i = 0; i < batch.errorCount; i++) {
+      const BatchFieldError &item = batch.errors[i];
+      if (i > 0) {
+        json += ",";
+      }
+      json += "{\"index\":" + String(item.index);
+      if (item.field < BATCH_FIELD_COUNT) {
+        json += ",\"key\":\"" + String(BATCH_FIELD_NAMES[item.field]) + "\"";
+      }
+      json += ",\"error\":\"" + String(getBatchErrorText(item.error)) + "\"}";
+    }
+    json += "],\"truncated\":" + String(batch.errorsTruncated ? 1 : 0);
+    json += "}";
+    sampleHeapLowWater();
+    server.send(400, "application/json", json);
+    return;
+  }
+
+  commitSettings(batch.staged);
+  sendStateJson();
+}
+
+bool readPresetIdArg(uint8_t &id) {
+  if (!server.hasArg("id")) {
+    return false;
+  }
+
+  const String &text = server.arg("id");
+  uint32_t value = 0;
+  if (!parseUnsignedToken(text.c_str(), text.c_str() + text.length(), value) || value >= PRESET_COUNT) {
+    return false;
+  }
+  id = static_cast<uint8_t>(value);
+  return true;
+}
+
+void sendPresetsJson() {
+  uint8_t presetId = getActivePresetId();
+  String json = "{\"active\":" + (presetId == PRESET_NONE ? String("-1") : String(presetId));
+  json += ",\"capacity\":" + String(PRESET_COUNT);
+  json += ",\"presets\":[";
+  bool first = true;
+  for (uint8_t i = 0; i < PRESET_COUNT; i++) {
+    if (!isPresetStored(i)) {
+      continue;
+    }
+    const ScenePreset &preset = presets[i];
+    if (!first) {
+      json += ",";
+    }
+    first = false;
+    json += "{\"id\":" + String(i);
+    json += ",\"name\":\"" + String(preset.name) + "\"";
+    json += ",\"brightness\":" + String(preset.brightness);
+    json += ",\"temperature\":" + String(preset.temperature);
+    json += "}";
+  }
+  json += "]}";
+
+  sampleHeapLowWater();
+  server.send(200, "application/json", json);
+}
+
+void handlePresets() {
+  sendPresetsJson();
+}
+
+void handlePresetSave() {
+  uint8_t id = 0;
+  if (!readPresetIdArg(id)) {
+    server.send(400, "application/json", "{\"error\":\"bad_id\"}");
+    return;
+  }
+
+  storePreset(id, server.hasArg("name") ? server.arg("name").c_str() : "");
+  sendPresetsJson();
+}
+
+void handlePresetRecall() {
+  uint8_t id = 0;
+  if (!readPresetIdArg(id)) {
+    server.send(400, "application/json", "{\"error\":\"bad_id\"}");
+    return;
+  }
+  if (!recallPreset(id)) {
+    server.send(404, "application/json", "{\"error\":\"empty_preset\"}");
+    return;
+  }
   sendStateJson();
 }
 
+void handlePresetDelete() {
+  uint8_t id = 0;
+  if (!readPresetIdArg(id)) {
+    server.send(400, "application/json", "{\"error\":\"bad_id\"}");
+    return;
+  }
+
+  deletePreset(id);
+  sendPresetsJson();
+}
+
+void handleGroup() {
+  const GroupPeer *leader = findGroupLeader();
+  String json = "{";
+  json += "\"group\":" + String(settings.groupId);
+  json += ",\"active\":" + String(isGroupActive() ? 1 : 0);
+  json += ",\"node\":" + String(groupNodeId);
+  json += ",\"leader\":" + String(leader != nullptr ? leader->nodeId : groupNodeId);
+  json += ",\"synced\":" + String(groupClockSynced ? 1 : 0);
+  json += ",\"rttMs\":" + String(groupLastSyncRtt);
+  json += ",\"groupTime\":" + String(groupNow());
+  json += ",\"peers\":" + String(countGroupPeers());
+  json += "}";
+
+  sampleHeapLowWater();
+  server.send(200, "application/json", json);
+}
+
+bool isOtaEnabled() {
+  return OTA_PASS[0] != '\0';
+}
+
+void writeOtaHealth() {
+  ESP.rtcUserMemoryWrite(OTA_HEALTH_RTC_BLOCK, reinterpret_cast<uint32_t *>(&otaHealth), sizeof(otaHealth));
+}
+
+// A freshly flashed image has to keep loop() running for OTA_HEALTHY_AFTER_MS.
+// After OTA_MAX_UNHEALTHY_BOOTS failed attempts the device boots into a
+// recovery mode that only serves the OTA endpoint, so a good image can be
+// pushed again. The previous image cannot be restored: eboot copies the new
+// image over it on the first boot.
+uint16_t parseImageTag(const char *md5) {
+  char prefix[5] = {};
+  strncpy(prefix, md5, 4);
+  return static_cast<uint16_t>(strtoul(prefix, nullptr, 16));
+}
+
+void checkOtaHealthOnBoot() {
+  ESP.rtcUserMemoryRead(OTA_HEALTH_RTC_BLOCK, reinterpret_cast<uint32_t *>(&otaHealth), sizeof(otaHealth));
+  if (otaHealth.magic != OTA_HEALTH_MAGIC || otaHealth.pending == 0) {
+    otaHealth = {OTA_HEALTH_MAGIC, 0, 0, 0};
+    writeOtaHealth();
+    return;
+  }
+  // If eboot did not copy the image, the old one is running and must not be
+  // confirmed as the update.
+  if (otaHealth.bootAttempts == 0 && parseImageTag(ESP.getSketchMD5().c_str()) != otaHealth.imageTag) {
+    otaHealth = {OTA_HEALTH_MAGIC, 0, 0, 0};
+    writeOtaHealth();
+    otaStatus.state = OtaState::Failed;
+    otaStatus.error = "image_not_applied";
+    Serial.println("[OTA] Running image is not the uploaded one, update was not applied");
+    return;
+  }
+
+  otaHealth.bootAttempts++;
+  writeOtaHealth();
+  otaRecoveryMode = otaHealth.bootAttempts > OTA_MAX_UNHEALTHY_BOOTS;
+  Serial.printf("[OTA] New image boot attempt %u%s\n",
+                otaHealth.bootAttempts,
+                otaRecoveryMode ? ", entering recovery mode" : "");
+}
+
+void confirmOtaHealthIfDue() {
+  if (otaHealth.pending == 0 || otaRecoveryMode || millis() < OTA_HEALTHY_AFTER_MS) {
+    return;
+  }
+  otaHealth.pending = 0;
+  otaHealth.bootAttempts = 0;
+  writeOtaHealth();
+  Serial.printf("[OTA] Image %04x confirmed healthy\n", otaHealth.imageTag);
+}
+
+void restartAfterOtaIfDue() {
+  if (otaRestartAt == 0 || static_cast<int32_t>(millis() - otaRestartAt) < 0) {
+    return;
+  }
+  otaRestartAt = 0;
+  // Update.end() left eboot's copy command in RTC memory; anything that wrote
+  // over it since would make the restart boot the old image again.
+  eboot_command command;
+  if (eboot_command_read(&command) != 0 || command.action != ACTION_COPY_RAW) {
+    otaHealth = {OTA_HEALTH_MAGIC, 0, 0, 0};
+    writeOtaHealth();
+    otaStatus.state = OtaState::Failed;
+    otaStatus.error = "eboot_command_lost";
+    Serial.println("[OTA] eboot command missing, not restarting");
+    return;
+  }
+  // The restart comes sooner than SAVE_DELAY_MS, and saves were held back during the upload.
+  if (pendingSave) {
+    saveSettings();
+  }
+  Serial.println("[OTA] Restarting into new image");
+  delay(50);
+  ESP.restart();
+}
+
+void trackOtaHeap() {
+  sampleHeapLowWater();
+  uint32_t freeHeap = ESP.getFreeHeap();
+  if (freeHeap < otaStatus.minFreeHeap) {
+    otaStatus.minFreeHeap = freeHeap;
+  }
+}
+
+void failOta(const char *error) {
+  if (Update.isRunning()) {
+    Update.end(false);
+  }
+  otaStatus.state = OtaState::Failed;
+  otaStatus.error = error;
+  otaStatus.durationMs = millis() - otaStatus.startedAt;
+  Serial.printf("[OTA] Failed: %s\n", error);
+}
+
+void beginOta() {
+  uint32_t freeHeap = ESP.getFreeHeap();
+  otaStatus = {OtaState::Receiving, nullptr, 0, millis(), 0, freeHeap, freeHeap};
+
+  if (!isOtaEnabled()) {
+    failOta("ota_disabled");
+    return;
+  }
+  if (!server.authenticate(OTA_USER, OTA_PASS)) {
+    failOta("unauthorized");
+    return;
+  }
+
+  const String &md5 = server.arg("md5");
+  if (md5.length() != 32) {
+    failOta("md5_required");
+    return;
+  }
+  // Updater allocates one flash-sector buffer; refuse to start when that would starve HTTP clients.
+  if (freeHeap < OTA_MIN_FREE_HEAP) {
+    failOta("low_memory");
+    return;
+  }
+
+  uint32_t maxSketchSpace = (ESP.getFreeSketchSpace() - 0x1000) & 0xFFFFF000;
+  if (!Update.begin(maxSketchSpace, U_FLASH) || !Update.setMD5(md5.c_str())) {
+    failOta("begin_failed");
+    return;
+  }
+  otaImageTag = parseImageTag(md5.c_str());
+  Serial.printf("[OTA] Receiving image, free heap %u\n", freeHeap);
+}
+
+void handleOtaUpload() {
+  HTTPUpload &upload = server.upload();
+
+  switch (upload.status) {
+    case UPLOAD_FILE_START:
+      beginOta();
+      break;
+
+    case UPLOAD_FILE_WRITE:
+      if (otaStatus.state != OtaState::Receiving) {
+        break;
+      }
+      // Updater fills a sector buffer and writes flash only when it is full,
+      // while lwIP keeps accepting the next segments into its own buffers.
+      if (Update.write(upload.buf, upload.currentSize) != upload.currentSize) {
+        failOta("write_failed");
+        break;
+      }
+      otaStatus.bytes += upload.currentSize;
+      break;
+
+    case UPLOAD_FILE_END:
+      if (otaStatus.state != OtaState::Receiving) {
+        break;
+      }
+      // end(true) checks the MD5 before the image is marked for eboot to copy.
+      if (!Update.end(true)) {
+        Serial.printf("[OTA] %s\n", Update.getErrorString().c_str());
+        failOta("verify_failed");
+        break;
+      }
+      otaStatus.state = OtaState::Done;
+      otaStatus.durationMs = millis() - otaStatus.startedAt;
+      Serial.printf("[OTA] Image OK: %u bytes in %ums\n", otaStatus.bytes, otaStatus.durationMs);
+      break;
+
+    case UPLOAD_FILE_ABORTED:
+      failOta("aborted");
+      break;
+  }
+
+  trackOtaHeap();
+}
+
+String getOtaStatusJson() {
+  String json = "{";
+  json += "\"bytes\":" + String(otaStatus.bytes);
+  json += ",\"durationMs\":" + String(otaStatus.durationMs);
+  json += ",\"minFreeHeap\":" + String(otaStatus.minFreeHeap);
+  json += ",\"peakHeapUsed\":" + String(otaStatus.startFreeHeap - otaStatus.minFreeHeap);
+  json += ",\"recovery\":" + String(otaRecoveryMode ? 1 : 0);
+  if (otaStatus.error != nullptr) {
+    json += ",\"error\":\"" + String(otaStatus.error) + "\"";
+  }
+  json += "}";
+  return json;
+}
+
+void handleOtaFinish() {
+  if (otaStatus.error != nullptr && strcmp(otaStatus.error, "unauthorized") == 0) {
+    server.requestAuthentication();
+    return;
+  }
+
+  if (otaStatus.state != OtaState::Done) {
+    if (otaStatus.state == OtaState::Receiving || otaStatus.state == OtaState::Idle) {
+      failOta("no_image");
+    }
+    int code = strcmp(otaStatus.error, "ota_disabled") == 0 ? 403 : 400;
+    sampleHeapLowWater();
+    server.send(code, "application/json", getOtaStatusJson());
+    return;
+  }
+
+  otaHealth = {OTA_HEALTH_MAGIC, 1, 0, otaImageTag};
+  writeOtaHealth();
+  otaRestartAt = millis() + OTA_RESTART_DELAY_MS;
+  sampleHeapLowWater();
+  server.send(200, "application/json", getOtaStatusJson());
+}
+
+void appendEnergyRing(String &json, const uint16_t *buckets, uint8_t size, uint32_t newest, uint32_t count) {
+  // Oldest first; count is capped by how many buckets have existed since the index started.
+  if (count > size) {
+    count = size;
+  }
+  if (count > newest + 1) {
+    count = newest + 1;
+  }
+  json += "[";
+  for (uint32_t i = 0; i < count; i++) {
+    if (i > 0) {
+      json += ",";
+    }
+    json += String(buckets[(newest + 1 - count + i) % size]);
+  }
+  json += "]";
+}
+
+void handleEnergy() {
+  uint32_t newestDay = energyLog.hourIndex / 24;
+  String json = "{";
+  json += "\"voltageMv\":" + String(STRIP_VOLTAGE_MV);
+  json += ",\"currentMa\":" + String(energyCurrentMa);
+  json += ",\"clockSynced\":" + String(energyClockAnchored ? 1 : 0);
+  json += ",\"hourIndex\":" + String(energyLog.hourIndex);
+  json += ",\"totalMah\":" + String(energyLog.totalMah);
+  json += ",\"totalMwh\":" + String(static_cast<uint32_t>(static_cast<uint64_t>(energyLog.totalMah) * STRIP_VOLTAGE_MV / 1000));
+  json += ",\"todayMah\":" + String(energyLog.days[newestDay % ENERGY_DAY_BUCKETS]);
+  json += ",\"hoursMah\":";
+  appendEnergyRing(json, energyLog.hours, ENERGY_HOUR_BUCKETS, energyLog.hourIndex, ENERGY_HOUR_BUCKETS);
+  json += ",\"daysMah\":";
+  appendEnergyRing(json, energyLog.days, ENERGY_DAY_BUCKETS, newestDay, ENERGY_DAY_BUCKETS);
+  json += "}";
+
+  sampleHeapLowWater();
+  server.send(200, "application/json", json);
+}
+
+void recordLoopStats(uint32_t startedAt) {
+  uint32_t spentUs = micros() - startedAt;
+  diagStats.loops++;
+  if (spentUs > diagStats.loopMaxUs) {
+    diagStats.loopMaxUs = spentUs;
+  }
+
+  sampleHeapLowWater();
+}
+
+void handleDiag() {
+  String json = "{";
+  json += "\"uptimeMs\":" + String(millis());
+  json += ",\"heap\":{";
+  json += "\"free\":" + String(ESP.getFreeHeap());
+  json += ",\"lowWater\":" + String(diagStats.heapLowWater);
+  json += ",\"maxBlock\":" + String(ESP.getMaxFreeBlockSize());
+  json += ",\"fragmentation\":" + String(ESP.getHeapFragmentation());
+  json += "}";
+  json += ",\"loop\":{";
+  json += "\"count\":" + String(diagStats.loops);
+  json += ",\"maxUs\":" + String(diagStats.loopMaxUs);
+  json += "}";
+  json += ",\"fade\":{";
+  json += "\"frames\":" + String(diagStats.fadeFrames);
+  json += ",\"missedFrames\":" + String(diagStats.missedFadeFrames);
+  json += "}";
+  json += ",\"mqtt\":{";
+  json += "\"enabled\":" + String(isMqttEnabled() ? 1 : 0);
+  json += ",\"connected\":" + String(mqttClient.connected() ? 1 : 0);
+  json += ",\"published\":" + String(mqttStats.published);
+  json += ",\"received\":" + String(mqttStats.received);
+  json += ",\"rejected\":" + String(mqttStats.rejected);
+  json += ",\"connects\":" + String(mqttStats.connects);
+  json += ",\"failedConnects\":" + String(mqttStats.failedConnects);
+  json += ",\"loopAvgUs\":" + String(static_cast<uint32_t>(mqttStats.loopCalls > 0 ? mqttStats.loopTotalUs / mqttStats.loopCalls : 0));
+  json += ",\"loopMaxUs\":" + String(mqttStats.loopMaxUs);
+  json += "}";
+  json += ",\"ota\":" + getOtaStatusJson();
+  json += "}";
+
+  // Benchmarks reset the window so maxima and low-water marks cover only their run.
+  if (server.hasArg("reset")) {
+    diagStats = {0, 0, ESP.getFreeHeap(), 0, 0};
+    mqttStats.loopCalls = 0;
+    mqttStats.loopTotalUs = 0;
+    mqttStats.loopMaxUs = 0;
+  }
+
+  sampleHeapLowWater();
+  server.send(200, "application/json", json);
+}
+
+void setupRecoveryServer() {
+  server.on("/api/ota", HTTP_POST, handleOtaFinish, handleOtaUpload);
+  server.on("/api/diag", HTTP_GET, handleDiag);
+  server.onNotFound([]() {
+    server.send(503, "application/json", "{\"error\":\"recovery_mode\"}");
+  });
+
+  server.begin();
+  Serial.println("[HTTP] Recovery server started on port 80");
+}
+
 void setupServer() {
   server.on("/", HTTP_GET, handleRoot);
   server.on("/api/state", HTTP_GET, handleState);
   server.on("/api/set", HTTP_GET, handleSet);
+  server.on("/api/batch", HTTP_POST, handleBatch);
+  server.on("/api/group", HTTP_GET, handleGroup);
+  server.on("/api/diag", HTTP_GET, handleDiag);
+  server.on("/api/energy", HTTP_GET, handleEnergy);
+  server.on("/api/ota", HTTP_POST, handleOtaFinish, handleOtaUpload);
+  server.on("/api/presets", HTTP_GET, handlePresets);
+  server.on("/api/preset/save", HTTP_GET, handlePresetSave);
+  server.on("/api/preset/recall", HTTP_GET, handlePresetRecall);
+  server.on("/api/preset/delete", HTTP_GET, handlePresetDelete);
 
   server.onNotFound([]() {
     server.send(404, "application/json", "{\"error\":\"not_found\"}");
@@ -787,8 +2753,17 @@ void setup() {
   Serial.println();
   Serial.println("[SYS] Booting...");
 
+  checkOtaHealthOnBoot();
+  if (otaRecoveryMode) {
+    connectWiFi();
+    setupRecoveryServer();
+    return;
+  }
+
   EEPROM.begin(EEPROM_SIZE);
   loadSettings();
+  loadPresets();
+  loadEnergyLog();
 
   // Sync fade state with loaded power state to avoid false transition on boot.
   lastPowerState = settings.power;
@@ -797,18 +2772,30 @@ void setup() {
   fadeActive = false;
 
   pinMode(BTN_PIN, INPUT_PULLUP);
+  groupNodeId = ESP.getChipId();
 
   initStrip();
   connectWiFi();
   initTimeSync();
   setupServer();
+  initMqtt();
 }
 
 void loop() {
+  uint32_t loopStartedAt = micros();
   server.handleClient();
   maintainWiFi();
+  restartAfterOtaIfDue();
+  if (otaRecoveryMode) {
+    return;
+  }
+  confirmOtaHealthIfDue();
+  maintainGroup();
+  maintainMqtt();
   handleButton();
   updateFadeAnimation();
+  updateEnergyAccounting();
   applyScheduleIfNeeded();
   saveSettingsIfNeeded();
+  recordLoopStats(loopStartedAt);
 }
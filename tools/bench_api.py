@@ -0,0 +1,262 @@
+#!/usr/bin/env python3
+"""Load and soak benchmark for the controller HTTP API.
+
+Replays the traffic the web UI produces against one controller and reports
+requests per second, latency percentiles and the device counters from
+/api/diag (heap low-water mark, missed fade frames, longest loop()).
+
+Scenarios:
+  slider  - slider drags: bursts of /api/set at the UI's 80 ms debounce
+  poll    - several open dashboards polling /api/state every 2 s
+  toggle  - power toggles through /api/set?on=
+  soak    - all of the above at once
+  max     - back-to-back /api/state and /api/set from --clients workers to find saturation
+
+    python3 tools/bench_api.py http://192.168.1.50 --scenario soak --duration 300 --tabs 4 --out soak.json
+"""
+
+import argparse
+import json
+import random
+import threading
+import time
+import urllib.error
+import urllib.parse
+import urllib.request
+
+SLIDER_DEBOUNCE_S = 0.08
+POLL_INTERVAL_S = 2.0
+SCENARIOS = ("slider", "poll", "toggle", "soak", "max")
+# Fields pushState() in the web UI sends with every change, in its order.
+UI_DEFAULTS = {"brightness": 70, "temperature": 2000, "on": 1, "schedule": 0, "onTime": "18:00", "offTime": "23:30"}
+
+
+class Recorder:
+    def __init__(self):
+        self.lock = threading.Lock()
+        self.samples = {}
+        self.errors = {}
+
+    def add(self, name, latency_ms, ok):
+        with self.lock:
+            if ok:
+                self.samples.setdefault(name, []).append(latency_ms)
+            else:
+                self.errors[name] = self.errors.get(name, 0) + 1
+
+    def summary(self, elapsed_s):
+        result = {}
+        for name in sorted(set(self.samples) | set(self.errors)):
+            latencies = sorted(self.samples.get(name, []))
+            errors = self.errors.get(name, 0)
+            entry = {
+                "requests": len(latencies) + errors,
+                "errors": errors,
+                "reqPerSec": round(len(latencies) / elapsed_s, 2) if elapsed_s > 0 else 0.0,
+            }
+            if latencies:
+                entry["latencyMs"] = {
+                    "min": round(latencies[0], 1),
+                    "p50": percentile(latencies, 50),
+                    "p90": percentile(latencies, 90),
+                    "p99": percentile(latencies, 99),
+                    "max": round(latencies[-1], 1),
+                }
+            result[name] = entry
+        return result
+
+
+def percentile(sorted_values, pct):
+    index = min(len(sorted_values) - 1, max(0, round(pct / 100.0 * len(sorted_values) + 0.5) - 1))
+    return round(sorted_values[index], 1)
+
+
+def fetch(base_url, path, timeout):
+    with urllib.request.urlopen(base_url + path, timeout=timeout) as response:
+        return response.read()
+
+
+def timed_request(recorder, name, base_url, path, timeout):
+    started = time.perf_counter()
+    try:
+        fetch(base_url, path, timeout)
+        ok = True
+    except (urllib.error.URLError, OSError):
+        ok = False
+    recorder.add(name, (time.perf_counter() - started) * 1000.0, ok)
+
+
+def read_ui_state(base_url, timeout):
+    try:
+        data = json.loads(fetch(base_url, "/api/state", timeout))
+    except (urllib.error.URLError, OSError, ValueError):
+        return dict(UI_DEFAULTS)
+    return {field: data.get(field, default) for field, default in UI_DEFAULTS.items()}
+
+
+def set_path(ui):
+    # Same query, encoding included, as URLSearchParams in pushState(): the firmware
+    # parses all six arguments on every change, not just the one that moved.
+    return "/api/set?" + urllib.parse.urlencode(ui)
+
+
+def read_diag(base_url, timeout, reset=False):
+    try:
+        return json.loads(fetch(base_url, "/api/diag" + ("?reset=1" if reset else ""), timeout))
+    except (urllib.error.URLError, OSError, ValueError):
+        return None
+
+
+def slider_worker(stop, recorder, args, rng, ui):
+    # A drag is a run of input events; the UI sends one request per 80 ms of movement.
+    while not stop.is_set():
+        field, low, high = rng.choice((("brightness", 0, 100), ("temperature", 1000, 4000)))
+        value = rng.randint(low, high)
+        for _ in range(rng.randint(5, 25)):
+            if stop.is_set():
+                return
+            value = max(low, min(high, value + rng.randint(-8, 8) * (1 if field == "brightness" else 30)))
+            ui[field] = value
+            tick = time.perf_counter()
+            timed_request(recorder, "set:slider", args.url, set_path(ui), args.timeout)
+            stop.wait(max(0.0, SLIDER_DEBOUNCE_S - (time.perf_counter() - tick)))
+        stop.wait(rng.uniform(0.5, 2.0))
+
+
+def poll_worker(stop, recorder, args, rng, ui):
+    stop.wait(rng.uniform(0.0, POLL_INTERVAL_S))
+    while not stop.is_set():
+        tick = time.perf_counter()
+        timed_request(recorder, "state:poll", args.url, "/api/state", args.timeout)
+        stop.wait(max(0.0, POLL_INTERVAL_S - (time.perf_counter() - tick)))
+
+
+def toggle_worker(stop, recorder, args, rng, ui):
+    while not stop.is_set():
+        ui["on"] = 0 if ui["on"] else 1
+        timed_request(recorder, "set:toggle", args.url, set_path(ui), args.timeout)
+        # Leave room for the 1 s power fade so missed frames during it are visible.
+        stop.wait(rng.uniform(1.5, 4.0))
+
+
+def saturate_worker(stop, recorder, args, rng, ui):
+    while not stop.is_set():
+        if rng.random() < 0.5:
+            timed_request(recorder, "state:max", args.url, "/api/state", args.timeout)
+        else:
+            ui["brightness"] = rng.randint(0, 100)
+            timed_request(recorder, "set:max", args.url, set_path(ui), args.timeout)
+
+
+def worker_rng(seed, index):
+    return random.Random(None if seed is None else seed + index)
+
+
+def run(args):
+    workers = []
+    if args.scenario in ("slider", "soak"):
+        workers.append(slider_worker)
+    if args.scenario in ("poll", "soak"):
+        workers.extend([poll_worker] * args.tabs)
+    if args.scenario in ("toggle", "soak"):
+        workers.append(toggle_worker)
+    if args.scenario == "max":
+        workers.extend([saturate_worker] * args.clients)
+
+    # Every worker behaves like its own open tab, starting from the device's current state.
+    ui = read_ui_state(args.url, args.timeout)
+    before = read_diag(args.url, args.timeout, reset=True)
+    recorder = Recorder()
+    stop = threading.Event()
+    # One generator per worker: a shared one would make the sequence depend on thread interleaving.
+    threads = [threading.Thread(target=worker, args=(stop, recorder, args, worker_rng(args.seed, index), dict(ui)),
+                                daemon=True)
+               for index, worker in enumerate(workers)]
+
+    started = time.perf_counter()
+    for thread in threads:
+        thread.start()
+    try:
+        stop.wait(args.duration)
+    except KeyboardInterrupt:
+        pass
+    stop.set()
+    for thread in threads:
+        thread.join(args.timeout + 1.0)
+    elapsed = time.perf_counter() - started
+
+    after = read_diag(args.url, args.timeout)
+    endpoints = recorder.summary(elapsed)
+    total = sum(entry["requests"] - entry["errors"] for entry in endpoints.values())
+
+    report = {
+        "url": args.url,
+        "scenario": args.scenario,
+        "durationS": round(elapsed, 1),
+        "tabs": args.tabs,
+        "seed": args.seed,
+        "clients": args.clients if args.scenario == "max" else None,
+        "startedAt": time.strftime("%Y-%m-%dT%H:%M:%S%z"),
+        "totalReqPerSec": round(total / elapsed, 2) if elapsed > 0 else 0.0,
+        "endpoints": endpoints,
+        "device": device_summary(before, after),
+    }
+    return report
+
+
+def device_summary(before, after):
+    if after is None:
+        return None
+    heap = after.get("heap", {})
+    summary = {
+        "heapFree": heap.get("free"),
+        "heapLowWater": heap.get("lowWater"),
+        "heapMaxBlock": heap.get("maxBlock"),
+        "loopMaxUs": after.get("loop", {}).get("maxUs"),
+        "fadeFrames": after.get("fade", {}).get("frames"),
+        "missedFadeFrames": after.get("fade", {}).get("missedFrames"),
+    }
+    if before is not None:
+        summary["heapFreeBefore"] = before.get("heap", {}).get("free")
+    return summary
+
+
+def print_report(report):
+    print(f"{report['scenario']} against {report['url']} for {report['durationS']} s: "
+          f"{report['totalReqPerSec']} req/s")
+    for name, entry in report["endpoints"].items():
+        latency = entry.get("latencyMs", {})
+        print(f"  {name:<12} {entry['requests']:>6} req {entry['errors']:>4} err {entry['reqPerSec']:>7} req/s"
+              f"  p50 {latency.get('p50', '-')} p90 {latency.get('p90', '-')} p99 {latency.get('p99', '-')}"
+              f" max {latency.get('max', '-')} ms")
+    device = report["device"]
+    if device is None:
+        print("  device: /api/diag unavailable")
+    else:
+        print(f"  device: heap low-water {device['heapLowWater']} B, loop max {device['loopMaxUs']} us, "
+              f"missed fade frames {device['missedFadeFrames']} of {device['fadeFrames']}")
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("url", help="controller base URL, e.g. http://192.168.1.50")
+    parser.add_argument("--scenario", choices=SCENARIOS, default="soak")
+    parser.add_argument("--duration", type=float, default=60.0, help="seconds to run")
+    parser.add_argument("--tabs", type=int, default=3, help="dashboards polling /api/state")
+    parser.add_argument("--clients", type=int, default=4, help="concurrent workers for the max scenario")
+    parser.add_argument("--timeout", type=float, default=5.0, help="per-request timeout, seconds")
+    parser.add_argument("--seed", type=int, default=None, help="random seed for reproducible traffic")
+    parser.add_argument("--out", default=None, help="write the JSON report to this file")
+    args = parser.parse_args()
+    args.url = args.url.rstrip("/")
+
+    report = run(args)
+    print_report(report)
+    if args.out:
+        with open(args.out, "w", encoding="utf-8") as handle:
+            json.dump(report, handle, indent=2)
+            handle.write("\n")
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,167 @@
+#!/usr/bin/env python3
+"""Host-side member of a controller group for checking multicast sync.
+
+Several instances can run on one Linux host next to real controllers. Each
+one joins the group, aligns its clock to the leader the same way the firmware
+does and prints the local time at which every received state change is due,
+so the spread between instances (and device logs) shows the alignment.
+
+    python3 tools/group_peer.py --group 1
+    python3 tools/group_peer.py --group 1 --send brightness=40,temperature=2700,on=1
+"""
+
+import argparse
+import random
+import select
+import socket
+import struct
+import time
+
+MULTICAST_IP = "239.255.76.69"
+PORT = 4210
+MAGIC = 0x4C45
+VERSION = 1
+BEACON, CLOCK_REQUEST, CLOCK_RESPONSE, STATE = 1, 2, 3, 4
+CROSSFADE = 0x01
+START_DELAY_MS = 150
+BEACON_INTERVAL_S = 1.0
+PEER_TIMEOUT_S = 5.0
+MAX_SYNC_RTT_MS = 100
+CLOCK_SAMPLES = 4
+
+# Mirrors GroupPacket in src/main.cpp.
+PACKET = struct.Struct("<HBBBBIIIIHBB")
+
+
+def millis():
+    return int(time.monotonic() * 1000) & 0xFFFFFFFF
+
+
+class Peer:
+    def __init__(self, group, node_id):
+        self.group = group
+        self.node_id = node_id
+        self.seq = 0
+        self.offset = 0
+        self.synced = False
+        self.samples = []
+        self.peers = {}
+        self.last_state = None
+
+        self.mcast = socket.socket(socket.AF_INET, socket.SOCK_DGRAM, socket.IPPROTO_UDP)
+        self.mcast.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+        self.mcast.bind(("", PORT))
+        membership = struct.pack("4s4s", socket.inet_aton(MULTICAST_IP), socket.inet_aton("0.0.0.0"))
+        self.mcast.setsockopt(socket.IPPROTO_IP, socket.IP_ADD_MEMBERSHIP, membership)
+        self.mcast.setsockopt(socket.IPPROTO_IP, socket.IP_MULTICAST_TTL, 1)
+
+        # Several instances share PORT on one host, so unicast to it reaches only one of them.
+        # Clock requests are multicast from a private port instead; only the leader answers,
+        # straight back to that port.
+        self.unicast = socket.socket(socket.AF_INET, socket.SOCK_DGRAM, socket.IPPROTO_UDP)
+        self.unicast.bind(("", 0))
+        self.unicast.setsockopt(socket.IPPROTO_IP, socket.IP_MULTICAST_TTL, 1)
+
+    def group_now(self):
+        return (millis() + self.offset) & 0xFFFFFFFF
+
+    def packet(self, kind, flags=0, t0=0, group_time=0, temperature=0, brightness=0, power=0):
+        self.seq = (self.seq + 1) & 0xFFFFFFFF
+        return PACKET.pack(MAGIC, VERSION, kind, self.group, flags, self.node_id, self.seq,
+                           t0, group_time, temperature, brightness, power)
+
+    def leader(self):
+        now = time.monotonic()
+        fresh = [(node, addr) for node, (addr, seen) in self.peers.items()
+                 if now - seen < PEER_TIMEOUT_S and node < self.node_id]
+        return min(fresh) if fresh else None
+
+    def send_state(self, brightness, temperature, power, crossfade):
+        start_at = (self.group_now() + START_DELAY_MS) & 0xFFFFFFFF
+        data = self.packet(STATE, CROSSFADE if crossfade else 0, 0, start_at, temperature, brightness, power)
+        for _ in range(2):
+            self.mcast.sendto(data, (MULTICAST_IP, PORT))
+        print(f"sent state brightness={brightness} temperature={temperature} on={power} start={start_at}")
+
+    def on_clock_response(self, fields):
+        received_at = millis()
+        rtt = (received_at - fields[7]) & 0xFFFFFFFF
+        if rtt > MAX_SYNC_RTT_MS:
+            return
+        self.samples = (self.samples + [(rtt, (fields[8] + rtt // 2 - received_at) & 0xFFFFFFFF)])[-CLOCK_SAMPLES:]
+        rtt, self.offset = min(self.samples)
+        if len(self.samples) == 1:
+            print(f"clock synced to leader, rtt={rtt}ms")
+        self.synced = True
+
+    def on_packet(self, data, addr, sock):
+        if len(data) != PACKET.size:
+            return
+        fields = PACKET.unpack(data)
+        magic, version, kind, group, flags, node_id, seq = fields[:7]
+        if magic != MAGIC or version != VERSION or group != self.group or node_id == self.node_id:
+            return
+        self.peers[node_id] = (addr[0], time.monotonic())
+
+        if kind == CLOCK_REQUEST and self.leader() is None:
+            sock.sendto(self.packet(CLOCK_RESPONSE, 0, fields[7], self.group_now()), addr)
+        elif kind == CLOCK_RESPONSE:
+            self.on_clock_response(fields)
+        elif kind == STATE and self.last_state != (node_id, seq):
+            self.last_state = (node_id, seq)
+            due_in = ((fields[8] - self.group_now() + 0x80000000) & 0xFFFFFFFF) - 0x80000000
+            due_wall = time.time() + due_in / 1000.0
+            print(f"state from {node_id:08x}: brightness={fields[10]} temperature={fields[9]} on={fields[11]} "
+                  f"crossfade={flags & CROSSFADE} due={due_wall:.3f} ({due_in:+d}ms)")
+
+    def run(self, send):
+        next_beacon = 0.0
+        beacons = 0
+        while True:
+            now = time.monotonic()
+            if now >= next_beacon:
+                next_beacon = now + BEACON_INTERVAL_S
+                beacons += 1
+                self.mcast.sendto(self.packet(BEACON, 0, 0, self.group_now()), (MULTICAST_IP, PORT))
+                leader = self.leader()
+                if leader is not None:
+                    self.unicast.sendto(self.packet(CLOCK_REQUEST, 0, millis()), (MULTICAST_IP, PORT))
+                elif not self.synced and beacons > 2:
+                    # Give existing members a few beacons to show up before claiming the clock.
+                    print("acting as clock reference")
+                    self.synced = True
+                if send is not None and self.synced:
+                    self.send_state(*send)
+                    send = None
+
+            readable, _, _ = select.select([self.mcast, self.unicast], [], [], 0.05)
+            for sock in readable:
+                data, addr = sock.recvfrom(64)
+                self.on_packet(data, addr, sock)
+
+
+def parse_send(text):
+    values = dict(item.split("=", 1) for item in text.split(","))
+    return (int(values.get("brightness", 70)), int(values.get("temperature", 2000)),
+            int(values.get("on", 1)), values.get("crossfade", "0") == "1")
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--group", type=int, required=True, help="group id, 1..254")
+    parser.add_argument("--node", type=lambda v: int(v, 0), default=None,
+                        help="node id; defaults to a random id above any ESP8266 chip id")
+    parser.add_argument("--send", type=parse_send, default=None,
+                        help="state to distribute once synced, e.g. brightness=40,temperature=2700,on=1")
+    args = parser.parse_args()
+
+    node_id = args.node if args.node is not None else random.randint(0x01000000, 0xFFFFFFFE)
+    print(f"node {node_id:08x} in group {args.group}")
+    try:
+        Peer(args.group, node_id).run(args.send)
+    except KeyboardInterrupt:
+        pass
+
+
+if __name__ == "__main__":
+    main()